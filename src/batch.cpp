@@ -0,0 +1,173 @@
+#include "batch.h"
+#include "llm.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static LLM& llm = LLM::instance();
+
+/* nearest rank of sorted values */
+static float percentile(const std::vector<float>& sorted, int p) {
+    if (sorted.empty()) return .0f;
+    size_t rank = std::ceil(p / 100.0 * sorted.size());
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+int Batch::init(const nlohmann::json& config) {
+    concurrency = std::max(0, config.value("concurrency", 0));
+    defaults = config.value("request", nlohmann::json::object());
+    if (!defaults.is_object()) defaults = nlohmann::json::object();
+    return 0;
+}
+
+std::string Batch::parse(const std::string& line, int n, nlohmann::json& id, 
+    nlohmann::json& req) const {
+    id = n;
+    nlohmann::json j = nlohmann::json::parse(line, nullptr, false);
+    if (!j.is_object()) return "not a json object";
+    if (j.contains("id")) id = j["id"];
+    else if (j.contains("request_id")) id = j["request_id"];
+
+    req = defaults;
+    if (j.contains("messages")) {
+        if (!j["messages"].is_array()) return "messages is not an array";
+        for (auto const& [key, value]: j.items()) {
+            if (key != "id" && key != "request_id") req[key] = value;
+        }
+        req.erase("system");
+        return "";
+    }
+
+    std::string prompt = "";
+    for (auto name: {"prompt", "content", "body"}) {
+        if (j.contains(name) && j[name].is_string()) {
+            prompt = j[name].get<std::string>();
+            break;
+        }
+    }
+    if (prompt.empty()) return "no messages or prompt";
+    std::string system = j.value("system", defaults.value("system", ""));
+    req.erase("system");
+    req["messages"] = nlohmann::json::array();
+    if (system.size() > 0) {
+        req["messages"].push_back({{"role", "system"}, {"content", system}});
+    }
+    req["messages"].push_back({{"role", "user"}, {"content", prompt}});
+    return "";
+}
+
+int Batch::run(const std::string& input, const std::string& output) {
+    std::ifstream in(input);
+    if (!in.is_open()) {
+        std::cerr << "batch: " << input << ": can't open" << std::endl;
+        return -1;
+    }
+    std::ofstream out(output, std::ios::trunc);
+    if (!out.is_open()) {
+        std::cerr << "batch: " << output << ": can't open" << std::endl;
+        return -1;
+    }
+    int limit = concurrency > 0 ? concurrency : llm.llm_slots();
+
+    /* written by the llm callbacks, read here once nothing is in flight */
+    std::mutex mtx;
+    std::condition_variable cv;
+    int in_flight = 0;
+    int n_requests = 0, n_failed = 0, n_from_cache = 0;
+    int64_t n_tokens = 0;
+    std::vector<float> latencies, ttfts, speeds;
+    auto write = [&](const nlohmann::json& j) {
+        out << j.dump(-1, ' ', false, 
+            nlohmann::json::error_handler_t::replace) << '\n';
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::string line;
+    for (int n = 1; std::getline(in, line); ++n) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        nlohmann::json id, req;
+        std::string error = parse(line, n, id, req);
+        std::unique_lock<std::mutex> lk(mtx);
+        ++n_requests;
+        if (error.size() > 0) {
+            ++n_failed;
+            write({{"id", id}, {"error", error}});
+            continue;
+        }
+        cv.wait(lk, [&]() { return in_flight < limit; });
+        ++in_flight;
+        lk.unlock();
+
+        auto submitted = std::chrono::steady_clock::now();
+        llm.generate(req, LLM::normal, {[&, id, submitted](int, 
+            const std::string& content, const llm_stats_t& stats) {
+            float latency = std::chrono::duration<float>(
+                std::chrono::steady_clock::now() - submitted).count();
+            std::lock_guard<std::mutex> lk(mtx);
+            if (stats.finish_reason == "error" || 
+                stats.finish_reason == "cancelled") {
+                ++n_failed;
+                write({{"id", id}, {"error", stats.finish_reason}});
+            } else {
+                latencies.push_back(latency);
+                n_tokens += stats.n_tokens;
+                if (stats.from_cache) {
+                    ++n_from_cache;
+                } else {
+                    ttfts.push_back(stats.ttft);
+                    if (stats.tokens_per_second > .0f) {
+                        speeds.push_back(stats.tokens_per_second);
+                    }
+                }
+                write({
+                    {"id", id}, 
+                    {"content", content}, 
+                    {"finish_reason", stats.finish_reason}, 
+                    {"latency", latency}, 
+                    {"ttft", stats.ttft}, 
+                    {"tokens_per_second", stats.tokens_per_second}, 
+                    {"n_tokens", stats.n_tokens}, 
+                    {"n_prompt", stats.n_prompt}, 
+                    {"n_cached", stats.n_cached}, 
+                    {"from_cache", stats.from_cache}
+                });
+            }
+            --in_flight;
+            cv.notify_all();
+        }, {}});
+    }
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        cv.wait(lk, [&]() { return in_flight == 0; });
+    }
+    out.flush();
+    float elapsed = std::chrono::duration<float>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    std::sort(ttfts.begin(), ttfts.end());
+    float speed = .0f;
+    for (float s: speeds) speed += s;
+    if (speeds.size() > 0) speed /= speeds.size();
+    std::cout << std::format("batch: {} requests, {} failed, {} from cache, "
+        "{:.1f} s with {} in flight\n", n_requests, n_failed, n_from_cache, 
+        elapsed, limit);
+    if (elapsed > .0f) {
+        std::cout << std::format("throughput: {:.2f} requests/s, "
+            "{:.1f} tokens/s\n", (n_requests - n_failed) / elapsed, 
+            n_tokens / elapsed);
+    }
+    std::cout << std::format("latency: p50 {:.2f} s, p95 {:.2f} s, "
+        "p99 {:.2f} s\n", percentile(latencies, 50), 
+        percentile(latencies, 95), percentile(latencies, 99));
+    std::cout << std::format("ttft: p50 {:.2f} s, decode: {:.1f} tokens/s "
+        "per request\n", percentile(ttfts, 50), speed);
+    return n_failed;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <string>
+
+/* chat requests from a jsonl file, without the ui. a line is either a
+   whole request:
+
+     {"id": "a", "messages": [...], "temperature": 0}
+
+   or a text that is sent as the user message, with an optional system
+   prompt:
+
+     {"id": "b", "system": "...", "prompt": "..."}
+
+   "content" and "body" are taken as the prompt too. fields missing from a
+   line come from the "request" of the config. at most concurrency requests
+   are in flight, one line per response is written to the output in the
+   order they finish. */
+class Batch {
+public:
+    static Batch& instance() {
+        static Batch _inst;
+        return _inst;
+    }
+
+    Batch(const Batch&) = delete;
+    Batch& operator=(const Batch&) = delete;
+
+    int init(const nlohmann::json& config);
+    /* 0 for the slots of the llm */
+    void set_concurrency(int n) { concurrency = n; };
+    /* the number of failed requests, -1 if a file can't be opened */
+    int run(const std::string& input, const std::string& output);
+
+private:
+    Batch() = default;
+    ~Batch() = default;
+
+    /* the request of one line, "" or what is wrong with it */
+    std::string parse(const std::string& line, int n, nlohmann::json& id, 
+        nlohmann::json& req) const;
+
+    int concurrency = 0;
+    nlohmann::json defaults = nlohmann::json::object();
+};
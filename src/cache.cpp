@@ -0,0 +1,423 @@
+#include "cache.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <openssl/evp.h>
+
+namespace fs = std::filesystem;
+
+typedef struct _cache_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_chunks;
+    uint32_t dim;
+    uint32_t reserved;
+    uint64_t text_size;
+} cache_header_t;
+
+static const char cache_magic[8] = {'C', 'L', 'L', 'M', 'D', 'O', 'C', '1'};
+static const uint32_t cache_version = 1;
+
+static size_t pad8(size_t n) { return (n + 7) & ~size_t(7); }
+
+static std::string hex(const unsigned char * digest, unsigned int n) {
+    std::string s;
+    for (unsigned int i=0; i<n; ++i) s += std::format("{:02x}", digest[i]);
+    return s;
+}
+
+static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int DocumentCache::init(const nlohmann::json& config) {
+    dir = config.value("dir", "cache");
+    max_bytes = uint64_t(std::max(0, config.value("max_mb", 512))) << 20;
+    if (!enabled()) return 0;
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) {
+        std::cerr << "cache: " << dir << ": " << ec.message() << std::endl;
+        max_bytes = 0;
+        return -1;
+    }
+    std::ifstream f(dir / "manifest.json");
+    if (f.is_open()) manifest = nlohmann::json::parse(f, nullptr, false);
+    if (!manifest.is_object()) manifest = nlohmann::json::object();
+    if (!manifest.contains("paths")) {
+        manifest["paths"] = nlohmann::json::object();
+    }
+    if (!manifest.contains("entries")) {
+        manifest["entries"] = nlohmann::json::object();
+    }
+    return 0;
+}
+
+int DocumentCache::shutdown() {
+    std::lock_guard<std::mutex> lk(mtx);
+    if (enabled() && dirty) save_manifest();
+    return 0;
+}
+
+std::string DocumentCache::key(const std::string& path) {
+    if (!enabled()) return "";
+    std::error_code ec;
+    fs::path p = fs::absolute(path, ec);
+    uint64_t size = fs::file_size(p, ec);
+    if (ec) return "";
+    int64_t mtime = fs::last_write_time(p, ec).time_since_epoch().count();
+    if (ec) return "";
+
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto& paths = manifest["paths"];
+        if (paths.contains(p.string())) {
+            auto const& seen = paths[p.string()];
+            if (seen.value("size", uint64_t(0)) == size && 
+                seen.value("mtime", int64_t(0)) == mtime) {
+                return seen.value("key", "");
+            }
+        }
+    }
+
+    std::ifstream f(p, std::ios::binary);
+    if (!f.is_open()) return "";
+    EVP_MD_CTX * md = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(md, EVP_sha256(), nullptr);
+    std::vector<char> buffer(1 << 20);
+    while (f) {
+        f.read(buffer.data(), buffer.size());
+        EVP_DigestUpdate(md, buffer.data(), f.gcount());
+    }
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int n = 0;
+    EVP_DigestFinal_ex(md, digest, &n);
+    EVP_MD_CTX_free(md);
+
+    std::string key = hex(digest, n);
+
+    std::lock_guard<std::mutex> lk(mtx);
+    manifest["paths"][p.string()] = {
+        {"size", size}, {"mtime", mtime}, {"key", key}
+    };
+    save_manifest();
+    return key;
+}
+
+bool DocumentCache::read(const std::string& key, cache_entry_t& entry) {
+    if (!enabled() || key.empty()) return false;
+    fs::path file = dir / (key + ".bin");
+    std::error_code ec;
+    if (!fs::exists(file, ec)) return false;
+
+    /* the whole file ends up in the entry, mapping it first saves nothing */
+    uint64_t size = fs::file_size(file, ec);
+    std::ifstream f(file, std::ios::binary);
+    if (ec || !f.is_open()) return false;
+    cache_header_t header;
+    if (size < sizeof(header) || 
+        !f.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+        return false;
+    }
+    if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) || 
+        header.version != cache_version) return false;
+    size_t text_end = sizeof(header) + pad8(header.text_size);
+    size_t chunks_end = text_end + size_t(header.n_chunks) * 16;
+    size_t vectors_end = chunks_end + 
+        size_t(header.n_chunks) * header.dim * sizeof(float);
+    if (size < vectors_end) return false;
+
+    entry.text.resize(header.text_size);
+    std::vector<uint64_t> bounds(2 * size_t(header.n_chunks));
+    entry.vectors.resize(size_t(header.n_chunks) * header.dim);
+    f.read(entry.text.data(), header.text_size);
+    f.seekg(text_end);
+    f.read(reinterpret_cast<char *>(bounds.data()), 
+        bounds.size() * sizeof(uint64_t));
+    f.read(reinterpret_cast<char *>(entry.vectors.data()), 
+        entry.vectors.size() * sizeof(float));
+    if (!f) {
+        std::cerr << "cache: " << file << ": read failed" << std::endl;
+        return false;
+    }
+    entry.chunks.clear();
+    entry.chunks.reserve(header.n_chunks);
+    for (size_t i=0; i<header.n_chunks; ++i) {
+        uint64_t begin = bounds[2 * i], end = bounds[2 * i + 1];
+        if (begin > end || end > header.text_size) return false;
+        entry.chunks.emplace_back(begin, end);
+    }
+    entry.dim = header.dim;
+
+    std::lock_guard<std::mutex> lk(mtx);
+    auto& entries = manifest["entries"];
+    if (entries.contains(key)) {
+        entries[key]["used"] = now();
+        dirty = true;
+    }
+    return true;
+}
+
+/* written next to the target and renamed, readers never see half a file */
+bool DocumentCache::write(const std::string& key, const cache_entry_t& entry) {
+    if (!enabled() || key.empty()) return false;
+    size_t n_chunks = entry.chunks.size();
+    if (entry.vectors.size() != n_chunks * entry.dim) return false;
+
+    fs::path file = dir / (key + ".bin");
+    fs::path tmp = file;
+    tmp += ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f.is_open()) return false;
+        cache_header_t header{};
+        std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+        header.version = cache_version;
+        header.n_chunks = n_chunks;
+        header.dim = entry.dim;
+        header.text_size = entry.text.size();
+        f.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        f.write(entry.text.data(), entry.text.size());
+        const char padding[8] = {0};
+        f.write(padding, pad8(entry.text.size()) - entry.text.size());
+        for (auto const& [begin, end]: entry.chunks) {
+            uint64_t bounds[2] = {begin, end};
+            f.write(reinterpret_cast<const char *>(bounds), sizeof(bounds));
+        }
+        f.write(reinterpret_cast<const char *>(entry.vectors.data()), 
+            entry.vectors.size() * sizeof(float));
+        if (!f) return false;
+    }
+
+    std::error_code ec;
+    fs::rename(tmp, file, ec);
+    if (ec) return false;
+    uint64_t size = fs::file_size(file, ec);
+
+    std::lock_guard<std::mutex> lk(mtx);
+    manifest["entries"][key] = {{"size", size}, {"used", now()}};
+    evict();
+    save_manifest();
+    return true;
+}
+
+/* least recently used entries go first. called with mtx held. */
+void DocumentCache::evict() {
+    auto& entries = manifest["entries"];
+    uint64_t total = 0;
+    for (auto const& [key, entry]: entries.items()) {
+        total += entry.value("size", uint64_t(0));
+    }
+
+    while (total > max_bytes && entries.size() > 1) {
+        auto oldest = entries.begin();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it.value().value("used", int64_t(0)) < 
+                oldest.value().value("used", int64_t(0))) oldest = it;
+        }
+        std::string key = oldest.key();
+        total -= oldest.value().value("size", uint64_t(0));
+        std::error_code ec;
+        fs::remove(dir / (key + ".bin"), ec);
+        entries.erase(key);
+
+        auto& paths = manifest["paths"];
+        for (auto it = paths.begin(); it != paths.end();) {
+            if (it.value().value("key", "") == key) it = paths.erase(it);
+            else ++it;
+        }
+    }
+}
+
+/* called with mtx held */
+void DocumentCache::save_manifest() {
+    fs::path file = dir / "manifest.json";
+    fs::path tmp = file;
+    tmp += ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::trunc);
+        if (!f.is_open()) return;
+        f << manifest.dump();
+        if (!f) return;
+    }
+    std::error_code ec;
+    fs::rename(tmp, file, ec);
+    if (!ec) dirty = false;
+}
+
+int ResponseCache::init(const nlohmann::json& config) {
+    on = config.value("on", false);
+    dir = config.value("dir", "cache/responses");
+    max_bytes = uint64_t(std::max(0, config.value("max_mb", 64))) << 20;
+    max_entries = std::max(0, config.value("memory_entries", 256));
+    if (!on || max_bytes == 0) return 0;
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) {
+        std::cerr << "response cache: " << dir << ": " << ec.message() 
+            << std::endl;
+        max_bytes = 0;
+        return -1;
+    }
+
+    /* the mtime orders the files left by earlier runs */
+    std::vector<std::tuple<fs::file_time_type, std::string, uint64_t>> found;
+    for (auto const& item: fs::directory_iterator(dir, ec)) {
+        if (!item.is_regular_file(ec) || 
+            item.path().extension() != ".txt") continue;
+        uint64_t size = item.file_size(ec);
+        if (ec) continue;
+        found.emplace_back(item.last_write_time(ec), 
+            item.path().stem().string(), size);
+    }
+    std::sort(found.begin(), found.end());
+    for (auto const& [used, key, size]: found) touch(key, size);
+    for (auto const& path: evict()) fs::remove(path, ec);
+    return 0;
+}
+
+std::string ResponseCache::key(const nlohmann::json& req) const {
+    if (!on || !req.is_object()) return "";
+    bool greedy = req.contains("temperature") && 
+        req["temperature"].is_number() && 
+        req["temperature"].get<double>() == .0;
+    bool seeded = req.contains("seed") && req["seed"].is_number_integer() && 
+        req["seed"].get<int64_t>() >= 0;
+    if (!greedy && !seeded) return "";
+
+    /* objects keep their keys sorted, so equal requests dump the same */
+    nlohmann::json canonical = req;
+    for (auto name: {"stream", "cache_prompt", "id_slot"}) {
+        canonical.erase(name);
+    }
+    std::string data = canonical.dump(-1, ' ', false, 
+        nlohmann::json::error_handler_t::replace);
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int n = 0;
+    if (!EVP_Digest(data.data(), data.size(), digest, &n, EVP_sha256(), 
+        nullptr)) return "";
+    return hex(digest, n);
+}
+
+bool ResponseCache::read(const std::string& key, std::string& content) {
+    if (!on || key.empty()) return false;
+    ++n_lookups;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            entries.splice(entries.begin(), entries, it->second);
+            content = it->second->second;
+            ++n_hits;
+            return true;
+        }
+    }
+    if (max_bytes == 0) return false;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (!file_index.contains(key)) return false;
+    }
+
+    fs::path file = dir / (key + ".txt");
+    std::ifstream f(file, std::ios::binary);
+    if (!f.is_open()) return false;
+    content.assign(std::istreambuf_iterator<char>(f), 
+        std::istreambuf_iterator<char>());
+    if (f.bad()) return false;
+    f.close();
+    /* the mtime keeps the order for the next run */
+    std::error_code ec;
+    fs::last_write_time(file, fs::file_time_type::clock::now(), ec);
+
+    std::lock_guard<std::mutex> lk(mtx);
+    touch(key, content.size());
+    remember(key, content);
+    ++n_hits;
+    return true;
+}
+
+/* written next to the target and renamed, readers never see half a file */
+void ResponseCache::write(const std::string& key, 
+    const std::string& content) {
+    if (!on || key.empty()) return;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        remember(key, content);
+    }
+    if (max_bytes == 0) return;
+
+    fs::path file = dir / (key + ".txt");
+    fs::path tmp = file;
+    tmp += ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f.is_open()) return;
+        f.write(content.data(), content.size());
+        if (!f) return;
+    }
+    std::error_code ec;
+    fs::rename(tmp, file, ec);
+    if (ec) return;
+
+    std::vector<fs::path> stale;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        touch(key, content.size());
+        stale = evict();
+    }
+    for (auto const& path: stale) fs::remove(path, ec);
+}
+
+/* called with mtx held */
+void ResponseCache::remember(const std::string& key, 
+    const std::string& content) {
+    if (max_entries == 0) return;
+    auto it = index.find(key);
+    if (it != index.end()) {
+        it->second->second = content;
+        entries.splice(entries.begin(), entries, it->second);
+        return;
+    }
+    entries.emplace_front(key, content);
+    index[key] = entries.begin();
+    while (entries.size() > max_entries) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+}
+
+/* moves key to the front of files. called with mtx held. */
+void ResponseCache::touch(const std::string& key, uint64_t size) {
+    auto it = file_index.find(key);
+    if (it != file_index.end()) {
+        disk_bytes -= it->second->second;
+        files.erase(it->second);
+    }
+    files.emplace_front(key, size);
+    file_index[key] = files.begin();
+    disk_bytes += size;
+}
+
+/* the files to remove past max_bytes, least recently used first, always
+   keeping the newest. called with mtx held. */
+std::vector<fs::path> ResponseCache::evict() {
+    std::vector<fs::path> stale;
+    while (disk_bytes > max_bytes && files.size() > 1) {
+        auto const& [key, size] = files.back();
+        stale.push_back(dir / (key + ".txt"));
+        disk_bytes -= size;
+        file_index.erase(key);
+        files.pop_back();
+    }
+    return stale;
+}
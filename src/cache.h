@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+typedef struct _cache_entry_t {
+    std::string text;
+    std::vector<std::pair<size_t, size_t>> chunks;  //byte ranges of text
+    int dim = 0;                                    //0 without embeddings
+    std::vector<float> vectors;                     //chunks x dim
+} cache_entry_t;
+
+/* extracted documents on disk, one file per content hash:
+
+     header   magic "CLLMDOC1", version, n_chunks, dim, text size
+     text     utf-8 bytes, padded to 8
+     chunks   n_chunks (begin, end) u64 byte offsets into text, 16 bytes
+              per chunk
+     vectors  n_chunks * dim f32
+
+   every section is read straight into the entry. a manifest keeps the hash
+   of every path seen (reused while size and mtime match) and the last use
+   of every entry for lru eviction. a read only marks the manifest dirty,
+   it is saved with the next write or at shutdown. */
+class DocumentCache {
+public:
+    int init(const nlohmann::json& config);
+    int shutdown();
+    bool enabled() const { return max_bytes > 0; };
+
+    /* content hash of the file at path, empty if it can't be read */
+    std::string key(const std::string& path);
+    bool read(const std::string& key, cache_entry_t& entry);
+    bool write(const std::string& key, const cache_entry_t& entry);
+
+private:
+    void evict();
+    void save_manifest();
+
+    std::filesystem::path dir = "cache";
+    uint64_t max_bytes = 0;
+    nlohmann::json manifest;
+    bool dirty = false;             //last uses not saved yet
+    std::mutex mtx;
+};
+
+/* replies to chat requests that give the same answer every time: the
+   temperature is 0 or a seed is pinned. the key is a hash of the request
+   with its keys sorted, without the fields that only steer the server
+   (stream, cache_prompt, id_slot). the last memory_entries replies are kept
+   in memory, all of them in one file per key under dir, the least recently
+   used files are removed past max_mb. */
+class ResponseCache {
+public:
+    int init(const nlohmann::json& config);
+    bool enabled() const { return on; };
+
+    /* empty if req can't be cached */
+    std::string key(const nlohmann::json& req) const;
+    bool read(const std::string& key, std::string& content);
+    void write(const std::string& key, const std::string& content);
+
+    int hits() const { return n_hits; };
+    int lookups() const { return n_lookups; };
+
+private:
+    void remember(const std::string& key, const std::string& content);
+    void touch(const std::string& key, uint64_t size);
+    std::vector<std::filesystem::path> evict();
+
+    bool on = false;
+    std::filesystem::path dir = "cache/responses";
+    uint64_t max_bytes = 0;         //0 keeps replies in memory only
+    size_t max_entries = 256;
+    /* most recently used first */
+    std::list<std::pair<std::string, std::string>> entries;
+    std::unordered_map<std::string, 
+        std::list<std::pair<std::string, std::string>>::iterator> index;
+    /* the files under dir with their sizes, most recently used first.
+       scanned once by init, kept up to date by read and write. */
+    std::list<std::pair<std::string, uint64_t>> files;
+    std::unordered_map<std::string, 
+        std::list<std::pair<std::string, uint64_t>>::iterator> file_index;
+    uint64_t disk_bytes = 0;
+    std::atomic<int> n_hits = 0;
+    std::atomic<int> n_lookups = 0;
+    std::mutex mtx;
+};
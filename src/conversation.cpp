@@ -0,0 +1,271 @@
+#include "conversation.h"
+#include "document.h"
+#include "think.h"
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+static const int message_overhead = 8;  //role markers of the chat template
+
+int Conversation::init(const nlohmann::json& config) {
+    slot = config.value("slot", -1);
+    ctx_size = std::max(256, config.value("ctx_size", 2048));
+    reserve = std::clamp(config.value("reserve", 512), 0, ctx_size / 2);
+    rolling_summary = config.value("overflow", "summarize") == "summarize";
+    summary_tokens = std::max(32, config.value("summary_tokens", 256));
+    return 0;
+}
+
+nlohmann::json Conversation::request(const nlohmann::json& base, 
+    std::string& content) {
+    std::lock_guard<std::mutex> lk(mtx);
+    nlohmann::json head = nlohmann::json::object();
+    if (base.contains("messages") && base["messages"].size() > 0) {
+        head = base["messages"][0];
+    }
+    if (head != system) {
+        system = head;
+        summary.clear();
+        summary_size = 0;
+        history.clear();
+        ++generation;
+        summarizing = false;
+        std::string system_prompt = system_content();
+        system_size = system_prompt.empty() ? 0 : estimate(system_prompt);
+        if (system_prompt.size() > 0) {
+            count(system_prompt, [this](int n) { 
+                system_size = n + message_overhead; 
+            });
+        }
+    }
+    this->base = base;
+    count_tools(base);
+
+    /* only the system message and the tools have to stay, a turn larger
+       than the rest is cut at a character and everything before it goes */
+    int limit = budget();
+    int content_tokens = estimate(content);
+    int room = limit - system_size - tools_size;
+    if (content_tokens > room) {
+        static const std::string note = 
+            "\n\n[the rest of this message was cut to fit the context]";
+        size_t keep = content.size() * std::max(room - message_overhead - 
+            estimate(note), 0) / content_tokens;
+        while (keep > 0 && (content[keep] & 0xc0) == 0x80) --keep;
+        std::cerr << "conversation: a message of about " << content_tokens << 
+            " tokens is cut to " << room << std::endl;
+        content = content.substr(0, keep) + note;
+        content_tokens = estimate(content);
+        evict_to(0);
+        summary.clear();
+        summary_size = 0;
+    } else if (history_tokens() + content_tokens > limit) {
+        evict_to((limit - content_tokens) / 2);
+        if (history_tokens() + content_tokens > limit) {
+            summary.clear();
+            summary_size = 0;
+        }
+    }
+
+    nlohmann::json req = base;
+    auto& messages = req["messages"];
+    messages = nlohmann::json::array();
+    std::string system_prompt = system_content();
+    if (system_prompt.size() > 0) {
+        nlohmann::json message = system;
+        if (!message.contains("role")) message["role"] = "system";
+        message["content"] = system_prompt;
+        messages.push_back(message);
+    }
+    /* the summary leads the first user message, the system message stays
+       the same prefix for the server's cache */
+    std::string lead = summary_content();
+    for (auto const& turn: history) {
+        messages.push_back({{"role", "user"}, {"content", lead + turn.user}});
+        messages.push_back({{"role", "assistant"}, 
+            {"content", turn.assistant}});
+        lead.clear();
+    }
+    messages.push_back({{"role", "user"}, {"content", lead + content}});
+
+    req["cache_prompt"] = true;
+    if (slot >= 0) req["id_slot"] = slot;
+    return req;
+}
+
+void Conversation::commit(const std::string& user, 
+    const std::string& assistant, const llm_stats_t& stats) {
+    std::lock_guard<std::mutex> lk(mtx);
+    int actual = stats.n_prompt + stats.n_cached;
+    total_prompt += actual;
+    total_cached += stats.n_cached;
+    history.push_back({user, assistant, 
+        estimate(user) + estimate(assistant)});
+    count(user + "\n" + assistant, [this, seq = dropped + 
+        history.size() - 1](int n) {
+        if (seq < size_t(dropped) || seq - dropped >= history.size()) return;
+        history[seq - dropped].tokens = n + 2 * message_overhead;
+    });
+
+    /* fold old turns before the next request has to evict them */
+    int limit = budget();
+    if (rolling_summary && !summarizing && 
+        history_tokens() > limit * 3 / 4) {
+        summarize(limit / 2);
+    }
+}
+
+void Conversation::clear() {
+    std::lock_guard<std::mutex> lk(mtx);
+    summary.clear();
+    history.clear();
+    ++generation;
+    summarizing = false;
+    total_prompt = total_cached = 0;
+}
+
+int Conversation::turns() {
+    std::lock_guard<std::mutex> lk(mtx);
+    return history.size();
+}
+
+int Conversation::tokens() {
+    std::lock_guard<std::mutex> lk(mtx);
+    return history_tokens();
+}
+
+void Conversation::prompt_tokens(int& n_prompt, int& n_cached) {
+    std::lock_guard<std::mutex> lk(mtx);
+    n_prompt = total_prompt;
+    n_cached = total_cached;
+}
+
+int Conversation::estimate(const std::string& s) const {
+    return std::lround(document_estimate_tokens(s) * scale) + 
+        message_overhead;
+}
+
+/* every count also tells how far off the local estimate is */
+void Conversation::count(std::string text, std::function<void (int)> apply) {
+    int estimated = document_estimate_tokens(text);
+    LLM::instance().tokenize(text, [this, estimated, apply, 
+        generation = generation](int n) {
+        if (n < 0) return;
+        std::lock_guard<std::mutex> lk(mtx);
+        if (estimated > 0) {
+            scale = std::clamp(.5f * scale + .5f * n / estimated, 
+                .25f, 4.0f);
+        }
+        if (generation == this->generation) apply(n);
+    });
+}
+
+int Conversation::history_tokens() const {
+    int tokens = system_size + tools_size + summary_size;
+    for (auto const& turn: history) tokens += turn.tokens;
+    return tokens;
+}
+
+/* the schemas go into the prompt with every request, they are counted
+   again only when the toolset changes */
+void Conversation::count_tools(const nlohmann::json& base) {
+    std::string text = "";
+    auto it = base.find("tools");
+    if (it != base.end() && it->is_string()) {
+        text = it->get<std::string>();
+    } else if (it != base.end() && it->is_array() && it->size() > 0) {
+        text = it->dump(-1, ' ', false, 
+            nlohmann::json::error_handler_t::replace);
+    }
+    if (text == tools) return;
+    tools = text;
+    tools_size = tools.empty() ? 0 : estimate(tools);
+    if (tools.empty()) return;
+    count(tools, [this, text](int n) {
+        if (text == tools) tools_size = n + message_overhead;
+    });
+}
+
+/* drop the oldest turns until the history is under target */
+int Conversation::evict_to(int target) {
+    int n = 0;
+    for (int tokens = history_tokens();
+         history.size() > 0 && tokens > target; ++n) {
+        tokens -= history.front().tokens;
+        history.pop_front();
+    }
+    dropped += n;
+    return n;
+}
+
+/* replace the oldest turns with a summary, the newest turn always stays
+   verbatim */
+void Conversation::summarize(int target) {
+    int tokens = history_tokens();
+    size_t n = 0;
+    for (; n + 1 < history.size() && tokens > target; ++n) {
+        tokens -= history[n].tokens;
+    }
+    if (n == 0) return;
+
+    std::string transcript = summary.size() > 0 ? 
+        std::format("Earlier summary:\n{}\n\n", summary) : "";
+    for (size_t i=0; i<n; ++i) {
+        transcript += std::format("User: {}\n\nAssistant: {}\n\n", 
+            history[i].user, history[i].assistant);
+    }
+
+    nlohmann::json req = base;
+    req.erase("tools");
+    req["messages"] = {
+        {{"role", "system"}, 
+            {"content", "Summarize the conversation below in a few "
+            "sentences. Keep the names, facts, numbers and decisions the "
+            "user may refer back to."}}, 
+        {{"role", "user"}, {"content", transcript}}
+    };
+    req["max_tokens"] = summary_tokens;
+    req["chat_template_kwargs"] = {{"enable_thinking", false}};
+
+    summarizing = true;
+    int last = dropped + n;
+    llm_handler_t handler;
+    handler.on_done = [this, last, generation = generation](int, 
+        const std::string& content, const llm_stats_t& stats) {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (generation != this->generation) return;
+        summarizing = false;
+        if (stats.finish_reason != "stop" && 
+            stats.finish_reason != "length") return;
+        std::string result = think_content(content);
+        if (result.empty()) return;
+
+        summary = result;
+        summary_size = estimate(summary_content()) - message_overhead;
+        count(summary_content(), [this, summary = summary](int n) {
+            if (summary == this->summary) summary_size = n;
+        });
+        int n = std::min<int>(last - dropped, history.size());
+        for (int i=0; i<n; ++i) history.pop_front();
+        if (n > 0) dropped += n;
+    };
+    handler.on_delta = [](int, const std::string&, const std::string&) {};
+    LLM::instance().generate(req, LLM::low, handler);
+}
+
+std::string Conversation::system_content() const {
+    if (system.is_object() && system.contains("content") && 
+        system["content"].is_string()) {
+        return system["content"].get<std::string>();
+    }
+    return "";
+}
+
+std::string Conversation::summary_content() const {
+    if (summary.empty()) return "";
+    return std::format("Summary of the earlier conversation:\n{}\n\n", 
+        summary);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "llm.h"
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+
+/* message history of one chat. turns are only ever appended, so every
+   request starts with the exact tokens of the previous one and the server
+   can reuse its kv cache for everything but the new turn.
+
+   requests stay under ctx_size minus reserve. the system prompt, the tool
+   schemas, the summary and every turn are counted by the server's
+   tokenizer, text it hasn't counted yet is estimated locally and scaled by
+   the counts that came back. past the budget the oldest turns are evicted
+   or folded into a rolling summary, down to half of it, so the turns after
+   that are append-only again. the summary goes in front of the first kept
+   turn, the system message never changes. a new turn too large for the
+   budget on its own is cut to fit. */
+class Conversation {
+public:
+    int init(const nlohmann::json& config);
+
+    /* base with its system message followed by the history and content.
+       a different system message starts a new conversation. content is
+       cut in place if it can't fit, commit it as it was sent. */
+    nlohmann::json request(const nlohmann::json& base, std::string& content);
+    /* keep a finished turn, user is the content as it was sent or the part
+       of it later requests should see */
+    void commit(const std::string& user, const std::string& assistant, 
+        const llm_stats_t& stats);
+    void clear();
+
+    int turns();
+    /* tokens of the next request without its new turn */
+    int tokens();
+    int budget() const { return ctx_size - reserve; };
+    /* prompt tokens over the whole conversation, and those served from
+       the server's cache */
+    void prompt_tokens(int& n_prompt, int& n_cached);
+
+private:
+    typedef struct _turn_t {
+        std::string user;
+        std::string assistant;
+        int tokens = 0;             //estimated until the server counted
+    } turn_t;
+
+    /* everything below is called with mtx held */
+    int estimate(const std::string& s) const;
+    /* ask the server for the tokens of text, apply runs with mtx held
+       unless the conversation was cleared meanwhile */
+    void count(std::string text, std::function<void (int)> apply);
+    int history_tokens() const;
+    int evict_to(int target);
+    void summarize(int target);
+    std::string system_content() const;
+    std::string summary_content() const;
+    void count_tools(const nlohmann::json& base);
+
+    int slot = -1;                  //pin to a server slot, -1 lets it pick
+    int ctx_size = 2048;            //context of one server slot
+    int reserve = 512;              //left for the answer
+    bool rolling_summary = true;    //false evicts old turns outright
+    int summary_tokens = 256;
+
+    nlohmann::json base;            //model and sampling of the last request
+    nlohmann::json system;
+    std::string summary;
+    int system_size = 0;            //tokens of the system message
+    std::string tools;              //serialized "tools" of the last request
+    int tools_size = 0;             //tokens of tools
+    int summary_size = 0;           //tokens of the summary
+    std::deque<turn_t> history;
+    int dropped = 0;                //turns removed from the front so far
+    int generation = 0;             //bumped by clear, drops stale summaries
+    bool summarizing = false;
+    float scale = 1.0f;             //server tokens per estimated token
+
+    int total_prompt = 0;
+    int total_cached = 0;
+    std::mutex mtx;
+};
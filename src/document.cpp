@@ -0,0 +1,507 @@
+#include "document.h"
+#include "think.h"
+#include "utf8/checked.h"
+#include "fpdfview.h"
+#include "fpdf_text.h"
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <initializer_list>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+static LLM& llm = LLM::instance();
+
+static size_t utf8_len(unsigned char c) {
+    if ((c & 0x80) == 0x00) return 1;
+    if ((c & 0xe0) == 0xc0) return 2;
+    if ((c & 0xf0) == 0xe0) return 3;
+    if ((c & 0xf8) == 0xf0) return 4;
+    return 1;
+}
+
+int document_estimate_tokens(std::string_view s) {
+    int ascii = 0, wide = 0;
+    for (size_t i=0; i<s.size(); i+=utf8_len(s[i])) {
+        if ((s[i] & 0x80) == 0x00) ++ascii;
+        else ++wide;
+    }
+    return (ascii + 3) / 4 + wide;
+}
+
+/* last natural place to cut s, 0 if there is none in its second half */
+static size_t break_pos(std::string_view s) {
+    const size_t min_pos = s.size() / 2;
+    for (std::string_view sep: {"\n\n", "\n", "。", "！", "？", 
+            ". ", "! ", "? ", " "}) {
+        size_t pos = s.rfind(sep);
+        if (pos != std::string_view::npos && pos >= min_pos) {
+            return pos + sep.size();
+        }
+    }
+    return 0;
+}
+
+std::vector<std::pair<size_t, size_t>> document_chunk_bounds(
+    std::string_view text, int max_tokens) {
+    std::vector<std::pair<size_t, size_t>> bounds;
+    size_t offset = 0;
+    while (text.size() > 0) {
+        /* longest prefix within budget */
+        int ascii = 0, wide = 0;
+        size_t end = 0;
+        while (end < text.size()) {
+            if ((text[end] & 0x80) == 0x00) ++ascii;
+            else ++wide;
+            if ((ascii + 3) / 4 + wide > max_tokens) break;
+            end += std::min(utf8_len(text[end]), text.size() - end);
+        }
+        if (end < text.size()) {
+            size_t pos = break_pos(text.substr(0, end));
+            if (pos > 0) end = pos;
+        }
+        if (end == 0) end = std::min(utf8_len(text[0]), text.size());
+
+        std::string_view chunk = text.substr(0, end);
+        if (chunk.find_first_not_of(" \t\r\n") != std::string_view::npos) {
+            bounds.emplace_back(offset, offset + end);
+        }
+        text.remove_prefix(end);
+        offset += end;
+    }
+    return bounds;
+}
+
+std::vector<std::string> document_chunks(std::string_view text, 
+    int max_tokens) {
+    std::vector<std::string> chunks;
+    for (auto const& [begin, end]: document_chunk_bounds(text, max_tokens)) {
+        chunks.emplace_back(text.substr(begin, end - begin));
+    }
+    return chunks;
+}
+
+static nlohmann::json user_request(const nlohmann::json& request, 
+    const std::string& content) {
+    nlohmann::json req = request;
+    req["messages"].push_back({{"role", "user"}, {"content", content}});
+    return req;
+}
+
+/* the request for the next turn, handler keeps the turn once answered.
+   content is sent with this request only, question is what the history
+   keeps of it, so excerpts don't pile up in later requests. */
+static nlohmann::json next_turn(const nlohmann::json& request, 
+    const std::string& content, const std::string& question, 
+    Conversation * conversation, llm_handler_t& handler) {
+    if (!conversation) return user_request(request, content);
+    std::string sent = content;
+    nlohmann::json req = conversation->request(request, sent);
+    /* a question sent as it is is kept as it was cut */
+    std::string turn = content == question ? sent : question;
+    auto on_done = handler.on_done;
+    handler.on_done = [conversation, turn, on_done](int id, 
+        const std::string& result, const llm_stats_t& stats) {
+        if ((stats.finish_reason == "stop" || 
+            stats.finish_reason == "length") && result.size() > 0) {
+            conversation->commit(turn, think_content(result), stats);
+        }
+        if (on_done) on_done(id, result, stats);
+    };
+    return req;
+}
+
+int Document::init(const nlohmann::json& config, llm_handler_t handler) {
+    chunk_tokens = std::max(64, config.value("chunk_tokens", 1024));
+    summary_tokens = std::max(32, config.value("summary_tokens", 384));
+    retrieval = config.value("retrieval", false);
+    index_chunk_tokens = std::max(32, config.value("index_chunk_tokens", 256));
+    embed_batch = std::max(1, config.value("embed_batch", 16));
+    embed_parallel = std::max(0, config.value("embed_parallel", 0));
+    top_k = std::max(1, config.value("top_k", 4));
+    cache.init(config.value("cache", nlohmann::json::object()));
+    default_handler = std::move(handler);
+    return 0;
+}
+
+int Document::shutdown() {
+    load_cancelled = true;
+    if (loader.joinable()) loader.join();
+    cache.shutdown();
+    return 0;
+}
+
+bool Document::load(const std::string& path, document_load_callback on_done) {
+    if (is_loading) return false;
+    if (loader.joinable()) loader.join();
+    is_loading = true;
+    load_cancelled = false;
+    pages_done = pages_total = 0;
+    loader = std::thread([this, path, on_done]() {
+        std::string key = cache.key(path);
+        cache_entry_t entry;
+        if (!cache.read(key, entry)) {
+            entry.text = path.ends_with(".pdf") ? load_pdf_file(path) : 
+                load_txt_file(path);
+            if (entry.text.size() > 0 && !load_cancelled) {
+                cache.write(key, entry);
+            }
+        }
+        if (!load_cancelled && on_done) on_done(entry.text);
+        if (!load_cancelled && entry.text.size() > 0) {
+            index(key, std::move(entry));
+        }
+        is_loading = false;
+    });
+    return true;
+}
+
+bool Document::progress(int& done, int& total) const {
+    if (!is_loading) return false;
+    done = pages_done;
+    total = pages_total;
+    return true;
+}
+
+std::string Document::load_txt_file(const std::string& path) {
+    std::ifstream f(path);
+    if (!f.is_open()) return "";
+    return std::string(std::istreambuf_iterator<char>(f), 
+        std::istreambuf_iterator<char>());
+}
+
+/* pdfium isn't thread-safe, not even across separate documents, so the
+   pages are read in order on the loader thread. the text is converted
+   straight into the result, which grows by at least the page's worst case
+   of 3 bytes per utf-16 unit. */
+std::string Document::load_pdf_file(const std::string& path) {
+    FPDF_DOCUMENT doc = FPDF_LoadDocument(path.c_str(), NULL);
+    if (!doc) return "";
+    int n_pages = FPDF_GetPageCount(doc);
+    pages_total = n_pages;
+
+    std::string content;
+    std::vector<unsigned short> u16_buffer;
+    for (int i=0; i<n_pages && !load_cancelled; ++i) {
+        int len = 0;
+        FPDF_PAGE page = FPDF_LoadPage(doc, i);
+        FPDF_TEXTPAGE text_page = page ? FPDFText_LoadPage(page) : nullptr;
+        if (text_page) {
+            len = FPDFText_CountChars(text_page);
+            u16_buffer.resize(len + 1);
+            /* count includes the terminating NUL */
+            len = FPDFText_GetText(text_page, 0, len, u16_buffer.data()) - 1;
+            FPDFText_ClosePage(text_page);
+        }
+        if (page) FPDF_ClosePage(page);
+
+        if (len > 0) {
+            size_t need = content.size() + len * 3 + 1;
+            if (need > content.capacity()) {
+                content.reserve(std::max(need, content.capacity() * 2));
+            }
+            try {
+                utf8::utf16to8(u16_buffer.cbegin(), 
+                    u16_buffer.cbegin() + len, std::back_inserter(content));
+            } catch (utf8::exception const&) {
+                /* keep what converted before the bad surrogate */
+            }
+            content.push_back('\n');
+        }
+        ++pages_done;
+    }
+    FPDF_CloseDocument(doc);
+    return content;
+}
+
+int Document::summarize(const nlohmann::json& request, 
+    const std::string& content, llm_handler_t handler /* = {} */, 
+    int id /* = 0 */) {
+    if (!handler.on_done) handler.on_done = default_handler.on_done;
+    if (!handler.on_delta) handler.on_delta = default_handler.on_delta;
+
+    std::vector<std::string> chunks = document_chunks(content, chunk_tokens);
+    if (chunks.size() <= 1) {
+        return llm.generate(user_request(request, content), LLM::normal, 
+            handler, id);
+    }
+
+    auto job = std::make_shared<job_t>();
+    job->id = id;
+    job->request = request;
+    job->handler = std::move(handler);
+    std::lock_guard<std::mutex> lk(mtx);
+    map(job, chunks);
+    jobs[job->id] = job;
+    return job->id;
+}
+
+bool Document::cancel(int id) {
+    std::vector<int> running;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = jobs.find(id);
+        if (it == jobs.end()) return false;
+        it->second->cancelled = true;
+        running = it->second->running;
+    }
+    /* queued requests report back right here, so not under mtx */
+    for (int r: running) llm.cancel(r);
+    return true;
+}
+
+/* one capped request per input, all queued at once so they spread over the
+   server slots. called with mtx held. */
+void Document::map(std::shared_ptr<job_t> job, 
+    const std::vector<std::string>& inputs) {
+    job->partials.assign(inputs.size(), "");
+    job->remaining = inputs.size();
+    for (int i=0; i<inputs.size(); ++i) {
+        nlohmann::json req = user_request(job->request, inputs[i]);
+        req["max_tokens"] = summary_tokens;
+        req["chat_template_kwargs"] = {{"enable_thinking", false}};
+        llm_handler_t handler;
+        handler.on_done = [this, job, i](int id, const std::string& content, 
+            const llm_stats_t& stats) {
+            on_partial(job, i, id, content, stats);
+        };
+        handler.on_delta = [](int, const std::string&, const std::string&) {};
+        int id = llm.generate(req, LLM::normal, std::move(handler));
+        job->running.push_back(id);
+        if (job->id == 0) job->id = id;
+    }
+}
+
+void Document::on_partial(std::shared_ptr<job_t> job, int index, int id, 
+    const std::string& content, const llm_stats_t& stats) {
+    bool done = false;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        std::erase(job->running, id);
+        std::string partial = think_content(content);
+        if (stats.finish_reason == "cancelled") job->cancelled = true;
+        else if (partial.empty()) job->failed = true;
+        job->partials[index] = std::move(partial);
+        done = (--job->remaining == 0);
+    }
+    if (done) reduce(job);
+}
+
+/* merge the partials of a finished level, the last merge streams to the
+   caller under the job id */
+void Document::reduce(std::shared_ptr<job_t> job) {
+    llm_stats_t stats;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (!job->cancelled && !job->failed) {
+            std::vector<std::string> groups;
+            std::string group;
+            int group_tokens = 0, n = 0;
+            for (auto const& partial: job->partials) {
+                int tokens = document_estimate_tokens(partial);
+                /* at least two per group so every level shrinks */
+                if (n >= 2 && group_tokens + tokens > chunk_tokens) {
+                    groups.push_back(std::move(group));
+                    group.clear();
+                    group_tokens = n = 0;
+                }
+                if (group.size() > 0) group += "\n\n";
+                group += partial;
+                group_tokens += tokens;
+                ++n;
+            }
+            if (n == 1 && groups.size() > 0) groups.back() += "\n\n" + group;
+            else groups.push_back(std::move(group));
+
+            if (groups.size() > 1) {
+                ++job->level;
+                map(job, groups);
+                return;
+            }
+
+            job->running = {llm.generate(user_request(job->request, 
+                groups[0]), LLM::normal, forward(job))};
+            return;
+        }
+        stats.finish_reason = job->cancelled ? "cancelled" : "error";
+    }
+    finish(job, "", stats);
+}
+
+void Document::finish(std::shared_ptr<job_t> job, const std::string& content, 
+    const llm_stats_t& stats) {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        jobs.erase(job->id);
+    }
+    if (job->handler.on_done) job->handler.on_done(job->id, content, stats);
+}
+
+llm_handler_t Document::forward(std::shared_ptr<job_t> job) {
+    llm_handler_t handler;
+    handler.on_done = [this, job](int, const std::string& content, 
+        const llm_stats_t& stats) {
+        finish(job, content, stats);
+    };
+    handler.on_delta = [job](int, const std::string& reason, 
+        const std::string& content) {
+        if (job->handler.on_delta) {
+            job->handler.on_delta(job->id, reason, content);
+        }
+    };
+    return handler;
+}
+
+void Document::index(const std::string& key, cache_entry_t entry) {
+    if (!retrieval) return;
+    int generation = 0;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        generation = ++index_generation;
+        document_index.clear();
+    }
+    if (entry.dim > 0) {
+        install(generation, entry);
+        return;
+    }
+
+    auto build = std::make_shared<index_build_t>();
+    build->generation = generation;
+    build->key = key;
+    build->entry = std::move(entry);
+    auto const& text = build->entry.text;
+    auto& chunks = build->entry.chunks;
+    chunks = document_chunk_bounds(text, index_chunk_tokens);
+    build->vectors.resize(chunks.size());
+    build->remaining = (chunks.size() + embed_batch - 1) / embed_batch;
+
+    /* the embedding server takes as many at once as it has slots, each
+       batch that comes back sends the next */
+    int limit = embed_parallel > 0 ? embed_parallel : llm.llm_slots();
+    for (int i=0; i<std::min(limit, build->remaining); ++i) {
+        embed_next(build);
+    }
+}
+
+void Document::embed_next(std::shared_ptr<index_build_t> build) {
+    auto const& text = build->entry.text;
+    auto const& chunks = build->entry.chunks;
+    size_t first = 0;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (build->next >= chunks.size()) return;
+        first = build->next;
+        build->next = std::min(chunks.size(), first + embed_batch);
+    }
+    std::vector<std::string> inputs;
+    for (size_t i=first; i<std::min(chunks.size(), first + embed_batch); 
+        ++i) {
+        inputs.push_back(text.substr(chunks[i].first, 
+            chunks[i].second - chunks[i].first));
+    }
+    llm.embed(inputs, [this, build, first](
+        const std::vector<std::vector<float>>& vectors) {
+        on_embedded(build, first, vectors);
+    });
+}
+
+/* batches finish in any order, the index is filled once all are back */
+void Document::on_embedded(std::shared_ptr<index_build_t> build, 
+    size_t first, const std::vector<std::vector<float>>& vectors) {
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        if (vectors.empty()) build->failed = true;
+        for (size_t i=0; i<vectors.size(); ++i) {
+            build->vectors[first + i] = vectors[i];
+        }
+        if (build->failed || build->generation != index_generation) return;
+        if (--build->remaining > 0) {
+            lk.unlock();
+            embed_next(build);
+            return;
+        }
+    }
+
+    /* last batch, nothing else touches build from here */
+    cache_entry_t& entry = build->entry;
+    entry.dim = build->vectors.size() > 0 ? build->vectors[0].size() : 0;
+    entry.vectors.reserve(build->vectors.size() * entry.dim);
+    for (auto const& v: build->vectors) {
+        if (v.size() != entry.dim) return;
+        entry.vectors.insert(entry.vectors.end(), v.begin(), v.end());
+    }
+    cache.write(build->key, entry);
+    install(build->generation, entry);
+}
+
+void Document::install(int generation, const cache_entry_t& entry) {
+    std::lock_guard<std::mutex> lk(mtx);
+    if (generation != index_generation) return;
+    document_index.clear();
+    for (size_t i=0; i<entry.chunks.size(); ++i) {
+        auto const& [begin, end] = entry.chunks[i];
+        const float * v = &entry.vectors[i * entry.dim];
+        document_index.add(std::vector<float>(v, v + entry.dim), 
+            entry.text.substr(begin, end - begin));
+    }
+}
+
+int Document::ask(const nlohmann::json& request, const std::string& question, 
+    Conversation * conversation /* = nullptr */, 
+    llm_handler_t handler /* = {} */, int id /* = 0 */) {
+    if (!handler.on_done) handler.on_done = default_handler.on_done;
+    if (!handler.on_delta) handler.on_delta = default_handler.on_delta;
+
+    auto job = std::make_shared<job_t>();
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (document_index.empty()) {
+            nlohmann::json req = next_turn(request, question, question, 
+                conversation, handler);
+            return llm.generate(req, LLM::high, handler, id);
+        }
+        job->id = id != 0 ? id : llm.reserve_id();
+        job->request = request;
+        job->handler = std::move(handler);
+        jobs[job->id] = job;
+    }
+
+    llm.embed({question}, [this, job, question, conversation](
+        const std::vector<std::vector<float>>& vectors) {
+        llm_stats_t stats;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (!job->cancelled) {
+                std::vector<std::pair<float, int>> hits;
+                if (vectors.size() > 0) {
+                    hits = document_index.search(vectors[0], top_k);
+                }
+                /* keep the excerpts in document order */
+                std::sort(hits.begin(), hits.end(), 
+                    [](auto const& a, auto const& b) {
+                    return a.second < b.second;
+                });
+                std::string context;
+                for (auto const& [score, row]: hits) {
+                    context += std::format("[{}]\n{}\n\n", row + 1, 
+                        document_index.text(row));
+                }
+                std::string content = context.empty() ? question : 
+                    std::format("Excerpts of the document:\n\n{}"
+                        "Question: {}", context, question);
+                llm_handler_t handler = forward(job);
+                nlohmann::json req = next_turn(job->request, content, 
+                    question, conversation, handler);
+                job->running = {llm.generate(req, LLM::high, handler)};
+                return;
+            }
+            stats.finish_reason = "cancelled";
+        }
+        finish(job, "", stats);
+    });
+    return job->id;
+}
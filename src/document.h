@@ -0,0 +1,135 @@
+#pragma once
+
+#include "llm.h"
+#include "cache.h"
+#include "conversation.h"
+#include "index.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/* rough token count for budgeting before the server sees the text:
+   ~4 ascii bytes per token, one token per wider codepoint. */
+int document_estimate_tokens(std::string_view s);
+/* split at paragraph, line, sentence or word boundaries so every chunk
+   stays under max_tokens, never inside a utf-8 sequence. bounds are
+   [begin, end) byte offsets, whitespace-only pieces are skipped. */
+std::vector<std::pair<size_t, size_t>> document_chunk_bounds(
+    std::string_view text, int max_tokens);
+std::vector<std::string> document_chunks(std::string_view text, 
+    int max_tokens);
+
+/* utf-8 text of the loaded file, empty if it couldn't be read */
+typedef std::function<void (const std::string&)> document_load_callback;
+
+class Document {
+public:
+    static Document& instance() {
+        static Document _inst;
+        return _inst;
+    }
+
+    Document(const Document&) = delete;
+    Document& operator=(const Document&) = delete;
+
+    int init(const nlohmann::json& config, llm_handler_t handler);
+    int shutdown();
+    /* extract the text of a .pdf or .txt file off the ui thread, or take
+       it from the cache, then index it. on_done runs on the loader thread.
+       false while another file is loading. */
+    bool load(const std::string& path, document_load_callback on_done);
+    bool loading() const { return is_loading; };
+    /* pages extracted so far, false when nothing is loading */
+    bool progress(int& done, int& total) const;
+    /* run the system prompt of request over content. text that doesn't fit
+       one request is summarized chunk by chunk across the server slots and
+       the partial summaries are merged until one request covers them.
+       returns the id the result is reported under, id if one was reserved
+       with llm.reserve_id() so it is known before anything can finish. */
+    int summarize(const nlohmann::json& request, const std::string& content, 
+        llm_handler_t handler = {}, int id = 0);
+    /* stop every request of a summary or question, false if id isn't one */
+    bool cancel(int id);
+    /* send question with the top_k chunks of the indexed document, or on
+       its own while there is none, as the next turn of conversation if
+       given. returns the id the answer is reported under, id if one was
+       reserved as for summarize. */
+    int ask(const nlohmann::json& request, const std::string& question, 
+        Conversation * conversation = nullptr, llm_handler_t handler = {}, 
+        int id = 0);
+
+private:
+    Document() = default;
+    ~Document() = default;
+
+    typedef struct _job_t {
+        int id = 0;
+        nlohmann::json request;             //model, sampling, system prompt
+        llm_handler_t handler;
+        int level = 0;
+        std::vector<std::string> partials;  //results of the current level
+        std::vector<int> running;
+        int remaining = 0;
+        bool cancelled = false;
+        bool failed = false;
+    } job_t;
+
+    typedef struct _index_build_t {
+        int generation = 0;
+        std::string key;                    //cache key of the document
+        cache_entry_t entry;
+        std::vector<std::vector<float>> vectors;
+        size_t next = 0;                    //first chunk not sent yet
+        int remaining = 0;
+        bool failed = false;
+    } index_build_t;
+
+    std::string load_txt_file(const std::string& path);
+    std::string load_pdf_file(const std::string& path);
+
+    void map(std::shared_ptr<job_t> job, 
+        const std::vector<std::string>& inputs);
+    void reduce(std::shared_ptr<job_t> job);
+    void on_partial(std::shared_ptr<job_t> job, int index, int id, 
+        const std::string& content, const llm_stats_t& stats);
+    void finish(std::shared_ptr<job_t> job, const std::string& content, 
+        const llm_stats_t& stats);
+    /* report a request's deltas and result under the job id */
+    llm_handler_t forward(std::shared_ptr<job_t> job);
+    /* replace the index of the previous document, chunks without vectors
+       are embedded in the background */
+    void index(const std::string& key, cache_entry_t entry);
+    /* embed the next batch of chunks, if there is one */
+    void embed_next(std::shared_ptr<index_build_t> build);
+    void on_embedded(std::shared_ptr<index_build_t> build, size_t first, 
+        const std::vector<std::vector<float>>& vectors);
+    void install(int generation, const cache_entry_t& entry);
+
+    int chunk_tokens = 1024;
+    int summary_tokens = 384;
+    bool retrieval = false;         //needs a server at the embedding_url
+    int index_chunk_tokens = 256;
+    int embed_batch = 16;
+    int embed_parallel = 0;         //batches in flight, 0 for llm slots
+    int top_k = 4;
+    llm_handler_t default_handler;
+
+    DocumentCache cache;
+    std::thread loader;
+    std::atomic<bool> is_loading = false;
+    std::atomic<bool> load_cancelled = false;
+    std::atomic<int> pages_done = 0;
+    std::atomic<int> pages_total = 0;
+
+    std::unordered_map<int, std::shared_ptr<job_t>> jobs;
+    VectorIndex document_index;
+    int index_generation = 0;   //drops batches of a superseded document
+    std::mutex mtx;
+};
@@ -0,0 +1,184 @@
+#include "http.h"
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+namespace http = boost::beast::http;
+
+bool http_parse_url(const std::string& url, http_url_t& u) {
+    size_t pos = url.find("://");
+    if (pos == std::string::npos) return false;
+    u.scheme = url.substr(0, pos);
+    std::string authority = url.substr(pos + 3);
+    authority = authority.substr(0, authority.find('/'));
+    size_t colon = authority.rfind(':');
+    if (colon == std::string::npos) {
+        u.host = authority;
+        u.port = (u.scheme == "https") ? "443" : "80";
+    } else {
+        u.host = authority.substr(0, colon);
+        u.port = authority.substr(colon + 1);
+    }
+    return u.host.size() > 0;
+}
+
+static http::request<http::string_body> make_request(http::verb method, 
+    const http_url_t& u, 
+    const std::string& token, 
+    const std::string& target, 
+    const std::string& body) {
+    http::request<http::string_body> req{method, target, 11};
+    req.set(http::field::host, u.host);
+    if (token.size() > 0) {
+        req.set(http::field::authorization, "Bearer " + token);
+    }
+    if (body.size() > 0) {
+        req.set(http::field::content_type, "application/json");
+        req.body() = body;
+    }
+    req.prepare_payload();
+    return req;
+}
+
+/* events are separated by a blank line, returns false once on_event asks
+   to stop or the stream is [DONE] */
+static bool dispatch_events(std::string& pending, 
+    const http_event_callback& on_event) {
+    for (size_t end = pending.find("\n\n");
+         end != std::string::npos;
+         end = pending.find("\n\n")) {
+        std::string event = pending.substr(0, end);
+        pending.erase(0, end + 2);
+
+        size_t start = 0;
+        while (start < event.size()) {
+            size_t eol = event.find('\n', start);
+            if (eol == std::string::npos) eol = event.size();
+            std::string line = event.substr(start, eol - start);
+            start = eol + 1;
+            if (!line.starts_with("data:")) continue;
+            line.erase(0, 5);
+            if (line.size() > 0 && line[0] == ' ') line.erase(0, 1);
+            if (line == "[DONE]" || !on_event(line)) return false;
+        }
+    }
+    return true;
+}
+
+asio::awaitable<int> http_async_request(std::string base_url, 
+    std::string token, 
+    std::string method, 
+    std::string target, 
+    std::string body, 
+    std::string& response, 
+    std::chrono::seconds timeout) {
+    http_url_t u;
+    if (!http_parse_url(base_url, u) || u.scheme != "http") {
+        std::cerr << "http: unsupported url " << base_url << std::endl;
+        co_return -1;
+    }
+
+    int status = -1;
+    try {
+        auto executor = co_await asio::this_coro::executor;
+        asio::ip::tcp::resolver resolver(executor);
+        beast::tcp_stream stream(executor);
+        stream.expires_after(timeout);
+        auto endpoints = co_await resolver.async_resolve(u.host, u.port, 
+            asio::use_awaitable);
+        co_await stream.async_connect(endpoints, asio::use_awaitable);
+
+        auto req = make_request(http::string_to_verb(method), u, token, 
+            target, body);
+        co_await http::async_write(stream, req, asio::use_awaitable);
+
+        beast::flat_buffer buffer;
+        http::response_parser<http::string_body> parser;
+        parser.body_limit(boost::none);
+        co_await http::async_read(stream, buffer, parser, asio::use_awaitable);
+        status = parser.get().result_int();
+        response = std::move(parser.get().body());
+
+        beast::error_code ec;
+        stream.socket().shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+    } catch (std::exception const& e) {
+        std::cerr << "http " << target << " error: " << e.what() << std::endl;
+        co_return -1;
+    }
+    co_return status;
+}
+
+asio::awaitable<int> http_async_post_stream(std::string base_url, 
+    std::string token, 
+    std::string target, 
+    std::string body, 
+    http_event_callback on_event, 
+    http_abort_t& abort) {
+    http_url_t u;
+    if (!http_parse_url(base_url, u) || u.scheme != "http") {
+        std::cerr << "http stream: unsupported url " << base_url << std::endl;
+        co_return -1;
+    }
+
+    auto executor = co_await asio::this_coro::executor;
+    beast::tcp_stream stream(executor);
+    abort = [&stream]() { stream.close(); };
+
+    int ret = 0;
+    try {
+        asio::ip::tcp::resolver resolver(executor);
+        stream.expires_after(std::chrono::seconds(10));
+        auto endpoints = co_await resolver.async_resolve(u.host, u.port, 
+            asio::use_awaitable);
+        co_await stream.async_connect(endpoints, asio::use_awaitable);
+
+        auto req = make_request(http::verb::post, u, token, target, body);
+        req.set(http::field::accept, "text/event-stream");
+        co_await http::async_write(stream, req, asio::use_awaitable);
+
+        beast::flat_buffer buffer;
+        http::response_parser<http::buffer_body> parser;
+        parser.body_limit(boost::none);
+        stream.expires_after(std::chrono::seconds(300));
+        co_await http::async_read_header(stream, buffer, parser, 
+            asio::use_awaitable);
+        bool ok = (parser.get().result() == http::status::ok);
+
+        char chunk[4 * 1024];
+        std::string pending;
+        bool reading = true;
+        while (!parser.is_done() && reading) {
+            parser.get().body().data = chunk;
+            parser.get().body().size = sizeof(chunk);
+            beast::error_code ec;
+            stream.expires_after(std::chrono::seconds(300));
+            co_await http::async_read_some(stream, buffer, parser, 
+                asio::redirect_error(asio::use_awaitable, ec));
+            if (ec == http::error::need_buffer) ec = {};
+            if (ec) throw beast::system_error{ec};
+            for (size_t i=0; i<sizeof(chunk) - parser.get().body().size; ++i) {
+                if (chunk[i] != '\r') pending.push_back(chunk[i]);
+            }
+            if (ok) reading = dispatch_events(pending, on_event);
+        }
+
+        beast::error_code ec;
+        stream.socket().shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+        if (!ok) {
+            std::cerr << "http stream error: " << parser.get().result_int()
+                << " " << pending << std::endl;
+            ret = -1;
+        }
+    } catch (std::exception const& e) {
+        std::cerr << "http stream error: " << e.what() << std::endl;
+        ret = -1;
+    }
+    abort = {};
+    co_return ret;
+}
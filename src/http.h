@@ -0,0 +1,37 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <boost/asio/awaitable.hpp>
+
+/* called with the payload of every "data:" line of a text/event-stream
+   response, return false to stop reading. */
+typedef std::function<bool (const std::string&)> http_event_callback;
+/* set while a request is in flight, closes its connection. only call it
+   from the executor the request runs on. */
+typedef std::function<void ()> http_abort_t;
+
+typedef struct _http_url_t {
+    std::string scheme = "http";
+    std::string host = "127.0.0.1";
+    std::string port = "80";
+} http_url_t;
+
+bool http_parse_url(const std::string& url, http_url_t& u);
+
+/* plain request, returns the http status or -1 on connection errors */
+boost::asio::awaitable<int> http_async_request(std::string base_url, 
+    std::string token, 
+    std::string method, 
+    std::string target, 
+    std::string body, 
+    std::string& response, 
+    std::chrono::seconds timeout);
+
+boost::asio::awaitable<int> http_async_post_stream(std::string base_url, 
+    std::string token, 
+    std::string target, 
+    std::string body, 
+    http_event_callback on_event, 
+    http_abort_t& abort);
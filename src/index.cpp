@@ -0,0 +1,59 @@
+#include "index.h"
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <vector>
+
+float index_dot(const float * a, const float * b, int n) {
+    float s0 = .0f, s1 = .0f, s2 = .0f, s3 = .0f;
+    int i = 0;
+    for (; i+4<=n; i+=4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i<n; ++i) s0 += a[i] * b[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+static void normalize(std::vector<float>& v) {
+    float norm = std::sqrt(index_dot(v.data(), v.data(), v.size()));
+    if (norm > .0f) {
+        for (auto& x: v) x /= norm;
+    }
+}
+
+void VectorIndex::clear() {
+    n_dim = 0;
+    data.clear();
+    texts.clear();
+}
+
+bool VectorIndex::add(std::vector<float> v, std::string text) {
+    if (v.empty()) return false;
+    if (n_dim == 0) n_dim = v.size();
+    if (v.size() != n_dim) return false;
+    normalize(v);
+    data.insert(data.end(), v.begin(), v.end());
+    texts.push_back(std::move(text));
+    return true;
+}
+
+std::vector<std::pair<float, int>> VectorIndex::search(
+    std::vector<float> query, int k) const {
+    std::vector<std::pair<float, int>> hits;
+    if (query.size() != n_dim || empty()) return hits;
+    normalize(query);
+
+    hits.reserve(size());
+    for (int i=0; i<size(); ++i) {
+        hits.emplace_back(index_dot(query.data(), vector(i), n_dim), i);
+    }
+    k = std::min<int>(k, hits.size());
+    std::partial_sort(hits.begin(), hits.begin() + k, hits.end(), 
+        [](auto const& a, auto const& b) { return a.first > b.first; });
+    hits.resize(k);
+    return hits;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/* cosine similarity search over normalized float vectors, rows are kept in
+   one contiguous block so a query is a single streaming pass */
+class VectorIndex {
+public:
+    int dim() const { return n_dim; };
+    int size() const { return texts.size(); };
+    bool empty() const { return texts.empty(); };
+    void clear();
+
+    /* normalizes v, false if its dimension doesn't match the index */
+    bool add(std::vector<float> v, std::string text);
+    /* best k rows as (score, row), highest first */
+    std::vector<std::pair<float, int>> search(std::vector<float> query, 
+        int k) const;
+    const std::string& text(int row) const { return texts[row]; };
+    const float * vector(int row) const { return &data[row * n_dim]; };
+
+private:
+    int n_dim = 0;
+    std::vector<float> data;
+    std::vector<std::string> texts;
+};
+
+/* four independent accumulators so the loop vectorizes without -ffast-math */
+float index_dot(const float * a, const float * b, int n);
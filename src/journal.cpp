@@ -0,0 +1,286 @@
+#include "journal.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unistd.h>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace fs = std::filesystem;
+namespace bip = boost::interprocess;
+
+static const char journal_magic[8] = {'C', 'L', 'L', 'M', 'J', 'N', 'L', '1'};
+static const size_t record_overhead = 3 * sizeof(uint32_t);
+
+/* fnv-1a, enough to tell a torn record from a complete one */
+static uint32_t checksum(std::string_view s) {
+    uint32_t h = 2166136261u;
+    for (unsigned char c: s) {
+        h ^= c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t load_u32(const char * p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static std::string encode(const chat_message_t& message) {
+    nlohmann::json j = {
+        {"time", message._time}, 
+        {"role", message._role}, 
+        {"reason", message._reason}, 
+        {"content", message._content}, 
+        {"ttft", message._ttft}, 
+        {"tokens_per_second", message._tokens_per_second}, 
+        {"n_prompt", message._n_prompt}, 
+        {"n_cached", message._n_cached}, 
+        {"n_drafted", message._n_drafted}, 
+        {"n_accepted", message._n_accepted}, 
+        {"from_cache", message._from_cache}
+    };
+    std::string payload = j.dump(-1, ' ', false, 
+        nlohmann::json::error_handler_t::replace);
+    uint32_t size = payload.size();
+    uint32_t sum = checksum(payload);
+
+    std::string record(payload.size() + record_overhead, '\0');
+    std::memcpy(record.data(), &size, sizeof(size));
+    std::memcpy(record.data() + 4, &sum, sizeof(sum));
+    std::memcpy(record.data() + 8, payload.data(), payload.size());
+    std::memcpy(record.data() + 8 + payload.size(), &size, sizeof(size));
+    return record;
+}
+
+static bool decode(std::string_view payload, chat_message_t& message) {
+    nlohmann::json j = nlohmann::json::parse(payload, nullptr, false);
+    if (!j.is_object()) return false;
+    message = {j.value("role", "assistant"), ""};
+    message._time = j.value("time", message._time);
+    message._reason = j.value("reason", "");
+    message._content = j.value("content", "");
+    message._ttft = j.value("ttft", .0f);
+    message._tokens_per_second = j.value("tokens_per_second", .0f);
+    message._n_prompt = j.value("n_prompt", 0);
+    message._n_cached = j.value("n_cached", 0);
+    message._n_drafted = j.value("n_drafted", 0);
+    message._n_accepted = j.value("n_accepted", 0);
+    message._from_cache = j.value("from_cache", false);
+    return true;
+}
+
+/* size of the complete record at offset, 0 if it is torn or corrupt */
+static size_t record_at(const char * base, size_t size, size_t offset) {
+    if (size - offset < record_overhead) return 0;
+    uint32_t n = load_u32(base + offset);
+    if (size - offset - record_overhead < n) return 0;
+    if (load_u32(base + offset + 8 + n) != n) return 0;
+    if (load_u32(base + offset + 4) != 
+        checksum({base + offset + 8, n})) return 0;
+    return n + record_overhead;
+}
+
+static bool valid_name(const std::string& name) {
+    return name.size() > 0 && name.size() <= 64 && 
+        std::all_of(name.begin(), name.end(), [](unsigned char c) {
+            return std::isalnum(c) || c == '-' || c == '_';
+        });
+}
+
+int Journal::init(const nlohmann::json& config) {
+    dir = config.value("dir", "sessions");
+    current = config.value("session", "default");
+    if (!valid_name(current)) current = "default";
+    if (!config.value("enabled", true)) return 0;
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) {
+        std::cerr << "journal: " << dir << ": " << ec.message() << std::endl;
+        return -1;
+    }
+    is_enabled = true;
+    stopping = false;
+    writer_thread = std::thread(&Journal::writer, this);
+    return 0;
+}
+
+int Journal::shutdown() {
+    if (!is_enabled) return 0;
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        drain(lk);
+        stopping = true;
+    }
+    cv.notify_all();
+    if (writer_thread.joinable()) writer_thread.join();
+    if (file) std::fclose(file);
+    file = nullptr;
+    is_enabled = false;
+    return 0;
+}
+
+size_t Journal::open(const std::string& name, size_t max) {
+    if (!is_enabled || !valid_name(name)) return 0;
+
+    std::unique_lock<std::mutex> lk(mtx);
+    drain(lk);
+    if (file) std::fclose(file);
+    file = nullptr;
+    current = name;
+    region.reset();
+    index.clear();
+
+    fs::path path = dir / (name + ".journal");
+    std::error_code ec;
+    uint64_t size = fs::exists(path, ec) ? fs::file_size(path, ec) : 0;
+    uint64_t valid = 0;
+    if (!ec && size >= sizeof(journal_magic)) {
+        try {
+            bip::file_mapping mapping(path.c_str(), bip::read_only);
+            region = std::make_unique<bip::mapped_region>(mapping, 
+                bip::read_only);
+            const char * base = static_cast<const char *>(
+                region->get_address());
+            size = region->get_size();
+            if (std::memcmp(base, journal_magic, sizeof(journal_magic))) {
+                std::cerr << "journal: " << path << ": not a journal" << 
+                    std::endl;
+                region.reset();
+                return 0;
+            }
+
+            /* a complete last record means nothing was torn, otherwise
+               find where the complete records end */
+            size_t end = size;
+            if (size > sizeof(journal_magic)) {
+                uint32_t n = load_u32(base + size - sizeof(uint32_t));
+                if (size - sizeof(journal_magic) < n + record_overhead || 
+                    record_at(base, size, size - n - record_overhead) != 
+                        n + record_overhead) {
+                    end = sizeof(journal_magic);
+                    for (size_t r;
+                         (r = record_at(base, size, end)) > 0; end += r);
+                }
+            }
+            valid = end;
+
+            /* walk back over the newest records, every one is checked
+               before the walk goes on from its leading size */
+            while (end > sizeof(journal_magic) && index.size() < max) {
+                uint32_t n = load_u32(base + end - sizeof(uint32_t));
+                if (end - sizeof(journal_magic) < n + record_overhead) break;
+                size_t begin = end - n - record_overhead;
+                if (record_at(base, end, begin) != n + record_overhead) break;
+                index.push_back(begin);
+                end = begin;
+            }
+            if (end > sizeof(journal_magic) && index.size() < max) {
+                std::cerr << "journal: " << path << ": corrupt record at " << 
+                    end << ", older messages are not shown" << std::endl;
+            }
+            std::reverse(index.begin(), index.end());
+        } catch (bip::interprocess_exception const& e) {
+            std::cerr << "journal: " << path << ": " << e.what() << 
+                std::endl;
+            region.reset();
+            index.clear();
+            return 0;
+        }
+    }
+
+    if (valid < size) {
+        if (valid > 0) {
+            std::cerr << "journal: " << path << ": dropped " << 
+                size - valid << " bytes of a torn record" << std::endl;
+        }
+        /* the mapped pages past the cut are never read */
+        fs::resize_file(path, valid, ec);
+    }
+    file = std::fopen(path.c_str(), "ab");
+    if (!file) {
+        std::cerr << "journal: " << path << ": " << std::strerror(errno) << 
+            std::endl;
+        return index.size();
+    }
+    if (valid == 0) {
+        std::fwrite(journal_magic, 1, sizeof(journal_magic), file);
+        std::fflush(file);
+    }
+    return index.size();
+}
+
+bool Journal::read(size_t i, chat_message_t& message) {
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!region || i >= index.size()) return false;
+    const char * base = static_cast<const char *>(region->get_address());
+    return decode({base + index[i] + 8, load_u32(base + index[i])}, message);
+}
+
+void Journal::append(const chat_message_t& message) {
+    if (!is_enabled) return;
+    std::string record = encode(message);
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (!file) return;
+        queue.push_back(std::move(record));
+    }
+    cv.notify_one();
+}
+
+std::string Journal::session() {
+    std::lock_guard<std::mutex> lk(mtx);
+    return current;
+}
+
+std::vector<std::string> Journal::sessions() {
+    std::vector<std::string> names;
+    std::error_code ec;
+    for (auto const& item: fs::directory_iterator{dir, ec}) {
+        if (item.is_regular_file() && 
+            item.path().extension() == ".journal") {
+            names.push_back(item.path().stem().string());
+        }
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+void Journal::writer() {
+    std::unique_lock<std::mutex> lk(mtx);
+    while (true) {
+        cv.wait(lk, [this]() { return stopping || queue.size() > 0; });
+        if (queue.empty()) break;
+
+        std::deque<std::string> batch;
+        batch.swap(queue);
+        std::FILE * f = file;
+        writing = true;
+        lk.unlock();
+        if (f) {
+            for (auto const& record: batch) {
+                std::fwrite(record.data(), 1, record.size(), f);
+            }
+            /* on disk before drain reports the batch written */
+            if (std::fflush(f) != 0 || ::fsync(::fileno(f)) != 0) {
+                std::cerr << "journal: " << std::strerror(errno) << 
+                    std::endl;
+            }
+        }
+        lk.lock();
+        writing = false;
+        idle.notify_all();
+    }
+}
+
+void Journal::drain(std::unique_lock<std::mutex>& lk) {
+    idle.wait(lk, [this]() { return queue.empty() && !writing; });
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "message.h"
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/interprocess/mapped_region.hpp>
+
+/* chat history on disk, one append-only file per named session:
+
+     header   magic "CLLMJNL1"
+     record   u32 size, u32 checksum, json of one message, u32 size
+
+   records are written by a background thread, which syncs every batch it
+   drains to disk. the trailing size lets open walk back from the end of
+   the memory-mapped file and index the newest records, which are decoded
+   by read when the view reaches them. a record torn by a crash fails its
+   checksum and is cut off together with everything after it. */
+class Journal {
+public:
+    static Journal& instance() {
+        static Journal _inst;
+        return _inst;
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    int init(const nlohmann::json& config);
+    /* write everything queued, then stop the writer */
+    int shutdown();
+    bool enabled() const { return is_enabled; };
+
+    /* make name the session appended to, returns how many of its newest
+       messages, at most max, read can give */
+    size_t open(const std::string& name, size_t max);
+    /* message i of those, 0 is the oldest. false if it doesn't decode. */
+    bool read(size_t i, chat_message_t& message);
+    /* queue a completed message for the current session */
+    void append(const chat_message_t& message);
+
+    std::string session();
+    std::vector<std::string> sessions();
+
+private:
+    Journal() = default;
+    ~Journal() = default;
+
+    void writer();
+    /* wait until the writer is idle, called with mtx held */
+    void drain(std::unique_lock<std::mutex>& lk);
+
+    std::filesystem::path dir = "sessions";
+    bool is_enabled = false;
+    std::string current = "default";
+    std::FILE * file = nullptr;
+    /* the session as it was opened, offsets of the indexed records */
+    std::unique_ptr<boost::interprocess::mapped_region> region;
+    std::vector<uint64_t> index;
+
+    std::deque<std::string> queue;  //encoded records
+    bool writing = false;
+    bool stopping = false;
+    std::thread writer_thread;
+    std::condition_variable cv;
+    std::condition_variable idle;
+    std::mutex mtx;
+};
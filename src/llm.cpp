@@ -1,126 +1,718 @@
 #include "llm.h"
+#include "http.h"
+#include "think.h"
 #include "openai.h"
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <exception>
 #include <format>
+#include <future>
 #include <mutex>
 #include <nlohmann/json_fwd.hpp>
 #include <string>
 #include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
+#include <boost/asio.hpp>
+
+namespace asio = boost::asio;
+
+static std::string json_string(const nlohmann::json& j, const char * key) {
+    if (j.contains(key) && j[key].is_string()) return j[key].get<std::string>();
+    return "";
+}
+
+/* a "tools" string is spliced into the body as it is, the array is
+   serialized once by its owner instead of being copied into every
+   request */
+static std::string request_body(nlohmann::json& req) {
+    std::string tools = "";
+    auto it = req.find("tools");
+    if (it != req.end() && it->is_string()) {
+        tools = std::move(it->get_ref<std::string&>());
+        req.erase(it);
+    }
+    std::string body = req.dump(-1, ' ', false, 
+        nlohmann::json::error_handler_t::replace);
+    if (tools.empty()) return body;
+    body.pop_back();
+    if (body.size() > 1) body.push_back(',');
+    body += "\"tools\":";
+    body += tools;
+    body.push_back('}');
+    return body;
+}
+
+static void timings_stats(const nlohmann::json& timings, llm_stats_t& stats) {
+    if (!timings.is_object()) return;
+    stats.n_tokens = timings.value("predicted_n", stats.n_tokens);
+    stats.tokens_per_second = timings.value("predicted_per_second", 
+        stats.tokens_per_second);
+    stats.n_prompt = timings.value("prompt_n", stats.n_prompt);
+    stats.n_cached = timings.value("cache_n", stats.n_cached);
+    stats.n_drafted = timings.value("draft_n", stats.n_drafted);
+    stats.n_accepted = timings.value("draft_n_accepted", stats.n_accepted);
+}
 
 int LLM::init(const nlohmann::json& config, llama_generate_callback func, 
+    llama_stream_callback stream_func, 
     llama_tool_callback tool_func, const bool verbos /* = false */) {
     base_url = config.value("base_url", 
         "http://127.0.0.1:8080");
-    std::string token = config.value("token", "");
+    token = config.value("token", "");
+    embedding_url = config.value("embedding_url", base_url);
+    stream = config.value("stream", true) && base_url.starts_with("http://");
+    n_slots = std::max(1, config.value("parallel", 1));
+    auto seconds = [](float s) {
+        return std::chrono::milliseconds(std::lround(std::max(.1f, s) * 1000));
+    };
+    tool_timeout = seconds(config.value("tool_timeout", 30.0f));
+    tool_timeouts.clear();
+    nlohmann::json timeouts = config.value("tool_timeouts", 
+        nlohmann::json::object());
+    for (auto const& [name, timeout]: timeouts.items()) {
+        if (timeout.is_number()) tool_timeouts[name] = seconds(timeout);
+    }
+    cache.init(config.value("response_cache", nlohmann::json::object()));
     std::string proxy_host_port = config.value("proxy_host_port", 
         "");
     openai::start(base_url, token, proxy_host_port, 
         verbos);
 
-    llama_thread = std::thread([this, func, tool_func]() {
-        llama_thread_running = true;
+    generate_func = func;
+    this->stream_func = stream_func;
+    this->tool_func = tool_func;
+    llama_thread_running = true;
+
+    pool = std::make_unique<asio::thread_pool>(n_slots);
+    tool_pool = std::make_unique<asio::thread_pool>(
+        std::max(1, config.value("tool_workers", 4)));
+    asio::co_spawn(ctx, health_monitor(), asio::detached);
+    /* run() sleeps in the reactor until a timer, socket or post wakes it */
+    llama_thread = std::thread([this]() { ctx.run(); });
+    return 0;
+}
+
+int LLM::shutdown() {
+    openai::stop();
+    llama_thread_running = false;
+    asio::post(ctx, [this]() {
+        health_timer.cancel();
+        std::lock_guard<std::mutex> lk(mtx);
+        for (auto& [id, request]: running) {
+            request->cancelled = true;
+            if (request->abort) request->abort();
+        }
+    });
+    if (llama_thread.joinable()) llama_thread.join();
+    if (pool) pool->join();
+    if (tool_pool) {
+        /* the calls were cancelled with their requests. a tool that
+           doesn't stop is left running instead of holding up the exit. */
+        tool_pool->stop();
+        auto joined = std::make_shared<std::promise<void>>();
+        auto done = joined->get_future();
+        std::thread([pool = tool_pool.get(), joined]() {
+            pool->join();
+            joined->set_value();
+        }).detach();
+        if (done.wait_for(std::chrono::seconds(2)) == 
+            std::future_status::timeout) {
+            std::cerr << "llm: tool calls still running at shutdown" << 
+                std::endl;
+            tool_pool.release();
+        }
+    }
+    return 0;
+}
+
+int LLM::generate(const nlohmann::json& req, int priority /* = normal */, 
+    llm_handler_t handler /* = {} */, int id /* = 0 */) {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (id == 0) id = next_id++;
+        auto request = std::make_shared<llm_request_t>();
+        request->id = id;
+        request->priority = priority;
+        request->body = req;
+        request->handler = std::move(handler);
+        auto it = std::find_if(requests.begin(), requests.end(), 
+            [priority](auto const& r) { return r->priority < priority; });
+        requests.insert(it, std::move(request));
+        ++pending;
+    }
+    asio::post(ctx, [this]() { dispatch(); });
+    return id;
+}
+
+bool LLM::cancel(int id) {
+    std::shared_ptr<llm_request_t> request;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto r = running.find(id);
+        if (r != running.end()) {
+            request = r->second;
+            request->cancelled = true;
+            asio::post(ctx, [request]() {
+                if (request->abort) request->abort();
+            });
+            return true;
+        }
+        auto it = std::find_if(requests.begin(), requests.end(), 
+            [id](auto const& r) { return r->id == id; });
+        if (it == requests.end()) return false;
+        request = std::move(*it);
+        requests.erase(it);
+    }
+
+    --pending;
+    llm_stats_t stats;
+    stats.finish_reason = "cancelled";
+    auto on_done = request->handler.on_done ? request->handler.on_done : 
+        generate_func;
+    if (on_done) on_done(id, "", stats);
+    return true;
+}
+
+void LLM::embed(const std::vector<std::string>& inputs, 
+    llm_embed_callback on_done) {
+    asio::co_spawn(ctx, embedding(inputs, std::move(on_done)), 
+        asio::detached);
+}
+
+std::unordered_map<std::string, llm_tool_stats_t> LLM::tool_stats() {
+    std::lock_guard<std::mutex> lk(mtx);
+    return tools;
+}
+
+bool LLM::cache_stats(int& hits, int& lookups) const {
+    hits = cache.hits();
+    lookups = cache.lookups();
+    return cache.enabled();
+}
+
+void LLM::tokenize(const std::string& content, 
+    llm_tokenize_callback on_done) {
+    asio::co_spawn(ctx, tokenization(content, std::move(on_done)), 
+        asio::detached);
+}
+
+int LLM::reserve_id() {
+    std::lock_guard<std::mutex> lk(mtx);
+    return next_id++;
+}
+
+void LLM::recheck() {
+    asio::post(ctx, [this]() { health_timer.cancel(); });
+}
+
+/* start queued requests while server slots are free */
+void LLM::dispatch() {
+    std::vector<std::shared_ptr<llm_request_t>> ready;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        while (llama_thread_running && active < n_slots && 
+            requests.size() > 0) {
+            auto request = std::move(requests.front());
+            requests.erase(requests.begin());
+            running[request->id] = request;
+            ++active;
+            ready.push_back(std::move(request));
+        }
+    }
+    for (auto& request: ready) {
+        asio::co_spawn(ctx, serve(std::move(request)), asio::detached);
+    }
+}
+
+asio::awaitable<void> LLM::serve(std::shared_ptr<llm_request_t> request) {
+    auto on_done = request->handler.on_done ? request->handler.on_done : 
+        generate_func;
+    nlohmann::json& req = request->body;
+    std::string model = json_string(req, "model");
+    std::string key = cache.key(req);
+    llm_stats_t stats;
+    bool delivered = false;
+    std::string content = "";
+    if (key.size() > 0) {
+        /* the cache may read a file, off the io thread */
+        co_await asio::post(*pool, asio::use_awaitable);
+        bool hit = cache.read(key, content);
+        co_await asio::post(ctx, asio::use_awaitable);
+        if (hit) {
+            stats.finish_reason = "stop";
+            stats.from_cache = true;
+            if (on_done) on_done(request->id, content, stats);
+            delivered = true;
+        }
+    }
+
+    std::string url = delivered ? "" : base_url;
+    int instance = 0;
+    if (router.acquire && !delivered) {
+        std::tie(url, instance) = co_await backend(model, request);
+        if (url.empty() && !request->cancelled) {
+            std::cerr << "no server for model " << model << std::endl;
+        }
+    }
+
+    /* a reply that used tools depends on more than the request */
+    bool used_tools = false;
+    while (!request->cancelled && !delivered && url.size() > 0) {
+        stats = {};
+        nlohmann::json result;
+        if (stream) {
+            result = co_await chat_stream(url, req, stats, request);
+        } else {
+            result = co_await chat_create(url, req, stats);
+        }
+        if (!result.contains("finish_reason") || !result.contains("message") || 
+            !result["message"].is_object()) {
+            std::cout << "unsupported: " << result.dump('\t') << std::endl;
+            break;
+        }
 
-        auto health_check = []() {
-            try {
-                auto result = openai::instance().get("/health");
-                if (result.contains("status") && 
-                    result["status"].get<std::string>() == "ok") {
-                    return true;
+        /* "" for a null finish_reason, such a reply isn't cached */
+        std::string finish_reason = json_string(result, "finish_reason");
+        nlohmann::json& message = result["message"];
+        if (finish_reason == "tool_calls" && message.contains("tool_calls") && 
+            message["tool_calls"].is_array()) {
+            /* a call without an id gets one, the results refer to it */
+            auto& calls = message["tool_calls"];
+            for (size_t i=0; i<calls.size(); ++i) {
+                if (calls[i].is_object() && 
+                    json_string(calls[i], "id").empty()) {
+                    calls[i]["id"] = std::format("call_{}_{}_{}", 
+                        request->id, req["messages"].size(), i);
                 }
-            } catch(std::exception const& e) {
-                std::cerr << "health error: " << e.what() << std::endl;
-            }
-            return false;
-        };
-        status = health_check() ? idle : none;
-
-        auto chat_create = [](const nlohmann::json& req) {
-            nlohmann::json result = {};
-            try {
-                auto response = openai::chat().create(req);
-                result = response["choices"][0];
-            } catch(std::exception& e) {
-                std::cerr << "Error during LLM generation: " << e.what() << std::endl;
             }
-            return result;
-        };
-
-        auto start = std::chrono::system_clock::now();
-        while (llama_thread_running) {
-            auto now = std::chrono::system_clock::now();
-            auto diff = 
-                std::chrono::duration_cast<std::chrono::seconds>(now - start);
-            if (diff.count() >= 10) {
-                status = health_check() ? idle : none;
-                start = now;
+            /* keep the conversation on this slot instead of re-queueing */
+            std::vector<nlohmann::json> tool_calls = 
+                calls.get<std::vector<nlohmann::json>>();
+            auto& messages = req["messages"];
+            messages.push_back(message);
+            used_tools = true;
+            std::vector<std::string> results = 
+                co_await call_tools(tool_calls, request);
+            if (request->cancelled) break;
+            for (size_t i=0; i<tool_calls.size(); ++i) {
+                nlohmann::json tool_call_result;
+                tool_call_result["role"] = "tool";
+                tool_call_result["tool_call_id"] = 
+                    json_string(tool_calls[i], "id");
+                tool_call_result["content"] = results[i];
+                messages.push_back(tool_call_result);
             }
+            continue;
+        }
 
-            nlohmann::json req;
-            {
-                std::unique_lock<std::mutex> lk(mtx);
-                if (!cv.wait_for(lk, std::chrono::milliseconds(100), 
-                    [this]() { return (status == busy); })) {
-                    continue;
+        content = "";
+        std::string reasoning = json_string(message, "reasoning_content");
+        if (reasoning.size() > 0) {
+            content += std::format("<think>{}</think>\n\n", reasoning);
+        }
+        if (message.contains("content") && message["content"].is_string()) {
+            content += message["content"].get<std::string>();
+        }
+
+        stats.finish_reason = request->cancelled ? "cancelled" : finish_reason;
+        if (on_done) on_done(request->id, content, stats);
+        delivered = true;
+        if (key.size() > 0 && !used_tools && stats.finish_reason == "stop") {
+            asio::post(*pool, [this, key, content]() {
+                cache.write(key, content);
+            });
+        }
+    }
+
+    if (!delivered) {
+        stats.finish_reason = request->cancelled ? "cancelled" : "error";
+        if (on_done) on_done(request->id, "", stats);
+    }
+    if (router.release && url.size() > 0) router.release(instance, stats);
+
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        running.erase(request->id);
+        --active;
+    }
+    --pending;
+    dispatch();
+}
+
+/* waits for the router. a cancelled request stops waiting, a url that
+   comes in after that is handed back at once */
+asio::awaitable<std::pair<std::string, int>> LLM::backend(std::string model, 
+    std::shared_ptr<llm_request_t> request) {
+    typedef struct _route_t {
+        asio::steady_timer signal;
+        std::string url = "";
+        int instance = 0;
+        bool done = false;
+        bool abandoned = false;
+        _route_t(asio::io_context& ctx) : 
+            signal(ctx, std::chrono::steady_clock::time_point::max()) {}
+    } route_t;
+    auto route = std::make_shared<route_t>(ctx);
+    router.acquire(model, [this, route](const std::string& url, 
+        int instance) {
+        asio::post(ctx, [this, route, url, instance]() {
+            if (route->abandoned) {
+                if (url.size() > 0 && router.release) {
+                    router.release(instance, {});
                 }
-                req = std::move(request);
+                return;
             }
+            route->url = url;
+            route->instance = instance;
+            route->done = true;
+            route->signal.cancel();
+        });
+    });
+
+    request->abort = [route]() { route->signal.cancel(); };
+    while (!route->done && !request->cancelled) {
+        boost::system::error_code ec;
+        co_await route->signal.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+    }
+    request->abort = {};
+    if (!route->done) {
+        route->abandoned = true;
+        co_return std::make_pair(std::string(""), 0);
+    }
+    co_return std::make_pair(route->url, route->instance);
+}
+
+asio::awaitable<bool> LLM::health_check() {
+    nlohmann::json result;
+    if (base_url.starts_with("http://")) {
+        std::string response;
+        int code = co_await http_async_request(base_url, token, "GET", 
+            "/health", "", response, std::chrono::seconds(2));
+        if (code != 200) co_return false;
+        result = nlohmann::json::parse(response, nullptr, false);
+    } else {
+        co_await asio::post(*pool, asio::use_awaitable);
+        try {
+            result = openai::instance().get("/health");
+        } catch(std::exception const& e) {
+            std::cerr << "health error: " << e.what() << std::endl;
+        }
+        co_await asio::post(ctx, asio::use_awaitable);
+    }
+    co_return result.is_object() && json_string(result, "status") == "ok";
+}
 
-            nlohmann::json result = chat_create(req);
-            if (result.contains("finish_reason") && result.contains("message")) {
-                std::string finish_reason = result["finish_reason"].get<std::string>();
-                if (finish_reason == "tool_calls") {
-                    nlohmann::json& message = result["message"];
-                    if (message.contains("tool_calls")) {
-                        std::vector<nlohmann::json> tool_calls = 
-                            message["tool_calls"].get<std::vector<nlohmann::json>>();
-                        auto& messages = req["messages"];
-                        messages.push_back(message);
-                        for (auto& tool: tool_calls) {
-                            nlohmann::json tool_call_result;
-                            tool_call_result["role"] = "tool";
-                            tool_call_result["tool_call_id"] = tool["id"].get<std::string>();
-                            tool_call_result["content"] = tool_func(tool);
-                            messages.push_back(tool_call_result);
-                        }
-//                        std::cout << "req: " << req.dump('\t') << std::endl;
-                        generate(req);
-                    }
-                } else {
-                    std::string content = "";
-                    nlohmann::json& message = result["message"];
-                    if (message.contains("reasoning_content")) {
-                        content += std::format("<think>{}</think>\n\n", 
-                            message["reasoning_content"].get<std::string>());
-                    }
-                    if (message.contains("content")) {
-                        content += message["content"].get<std::string>();
-                    }
-
-                    status = idle;
-                    if (func) func(content);
+asio::awaitable<void> LLM::embedding(std::vector<std::string> inputs, 
+    llm_embed_callback on_done) {
+    std::vector<std::vector<float>> vectors;
+    nlohmann::json req = {{"input", inputs}};
+    std::string response;
+    int code = co_await http_async_request(embedding_url, token, "POST", 
+        "/v1/embeddings", req.dump(), response, std::chrono::seconds(60));
+    nlohmann::json result = nlohmann::json::parse(response, nullptr, false);
+    if (code == 200 && result.contains("data") && result["data"].is_array() && 
+        result["data"].size() == inputs.size()) {
+        vectors.resize(inputs.size());
+        try {
+            for (auto const& item: result["data"]) {
+                size_t index = item.value("index", 0);
+                if (index < vectors.size() && item.contains("embedding")) {
+                    vectors[index] = 
+                        item["embedding"].get<std::vector<float>>();
                 }
-            } else {
-                std::cout << "unsupported: " << result.dump('\t') << std::endl;
-                status = idle;
             }
+        } catch (nlohmann::json::exception const& e) {
+            std::cerr << "embedding error: " << e.what() << std::endl;
+            vectors.clear();
         }
-    });
-    return 0;
+    } else {
+        std::cerr << "embedding error: " << code << " " << response 
+            << std::endl;
+    }
+    if (on_done) on_done(vectors);
 }
 
-int LLM::shutdown() {
-    openai::stop();
-    llama_thread_running = false;
-    if (llama_thread.joinable()) llama_thread.join();
-    return 0;
+/* the calls run side by side on the tool pool. the batch is done once
+   every call returned or ran past its timeout, a cancelled request stops
+   waiting at once. a late result is only counted in the stats. */
+asio::awaitable<std::vector<std::string>> LLM::call_tools(
+    const std::vector<nlohmann::json>& tool_calls, 
+    std::shared_ptr<llm_request_t> request) {
+    typedef struct _batch_t {
+        std::vector<std::string> results;
+        std::vector<bool> resolved;
+        size_t remaining;
+        asio::steady_timer timer;
+        _batch_t(asio::io_context& ctx, size_t n) : results(n), 
+            resolved(n, false), remaining(n), timer(ctx) {}
+    } batch_t;
+    auto batch = std::make_shared<batch_t>(ctx, tool_calls.size());
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::chrono::steady_clock::time_point> deadlines;
+    std::vector<std::string> names;
+    std::vector<std::shared_ptr<llm_tool_call_t>> calls;
+    for (size_t i=0; i<tool_calls.size(); ++i) {
+        std::string name = "";
+        if (tool_calls[i].contains("function")) {
+            name = json_string(tool_calls[i]["function"], "name");
+        }
+        auto it = tool_timeouts.find(name);
+        deadlines.push_back(start + 
+            (it == tool_timeouts.end() ? tool_timeout : it->second));
+        names.push_back(name);
+        auto call = std::make_shared<llm_tool_call_t>();
+        call->call = tool_calls[i];
+        call->deadline = deadlines.back();
+        calls.push_back(call);
+
+        asio::post(*tool_pool, [this, batch, i, name, call]() {
+            auto begin = std::chrono::steady_clock::now();
+            std::string result = "";
+            if (tool_func && !call->cancelled) result = tool_func(call);
+            float ms = std::chrono::duration<float, std::milli>(
+                std::chrono::steady_clock::now() - begin).count();
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                auto& stats = tools[name];
+                ++stats.calls;
+                stats.total_ms += ms;
+                stats.max_ms = std::max(stats.max_ms, ms);
+            }
+            asio::post(ctx, [batch, i, result = std::move(result)]() mutable {
+                if (batch->resolved[i]) return;
+                batch->results[i] = std::move(result);
+                batch->resolved[i] = true;
+                if (--batch->remaining == 0) batch->timer.cancel();
+            });
+        });
+    }
+
+    request->abort = [batch]() { batch->timer.cancel(); };
+    while (batch->remaining > 0 && !request->cancelled) {
+        auto now = std::chrono::steady_clock::now();
+        auto next = std::chrono::steady_clock::time_point::max();
+        for (size_t i=0; i<deadlines.size(); ++i) {
+            if (batch->resolved[i]) continue;
+            if (deadlines[i] > now) {
+                next = std::min(next, deadlines[i]);
+                continue;
+            }
+            batch->results[i] = std::format("error: {} timed out", names[i]);
+            batch->resolved[i] = true;
+            --batch->remaining;
+            calls[i]->cancel();
+            std::lock_guard<std::mutex> lk(mtx);
+            ++tools[names[i]].timeouts;
+        }
+        if (batch->remaining == 0) break;
+
+        batch->timer.expires_at(next);
+        boost::system::error_code ec;
+        co_await batch->timer.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+    }
+    request->abort = {};
+    for (size_t i=0; i<calls.size(); ++i) {
+        if (!batch->resolved[i]) calls[i]->cancel();
+    }
+    co_return batch->results;
 }
 
-int LLM::generate(const nlohmann::json& req) {
-    std::lock_guard<std::mutex> lk(mtx);
-    request = req;
-    status = busy;
-    cv.notify_one();
-    return 0;
+asio::awaitable<void> LLM::tokenization(std::string content, 
+    llm_tokenize_callback on_done) {
+    nlohmann::json req = {{"content", std::move(content)}};
+    std::string response;
+    int code = co_await http_async_request(base_url, token, "POST", 
+        "/tokenize", req.dump(-1, ' ', false, 
+            nlohmann::json::error_handler_t::replace), 
+        response, std::chrono::seconds(10));
+    nlohmann::json result = nlohmann::json::parse(response, nullptr, false);
+    int n = -1;
+    if (code == 200 && result.contains("tokens") && 
+        result["tokens"].is_array()) {
+        n = result["tokens"].size();
+    }
+    if (on_done) on_done(n);
+}
+
+/* probes fast until the server is up, then every 10 seconds */
+asio::awaitable<void> LLM::health_monitor() {
+    while (llama_thread_running) {
+        status = (co_await health_check()) ? idle : none;
+        if (!llama_thread_running) break;
+
+        health_timer.expires_after(std::chrono::seconds(
+            status == none ? 1 : 10));
+        boost::system::error_code ec;
+        co_await health_timer.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+    }
+}
+
+/* a plain http url, which is where the router sends a request, is asked
+   from the io thread. anything else goes through openai on the pool. */
+asio::awaitable<nlohmann::json> LLM::chat_create(std::string url, 
+    nlohmann::json req, llm_stats_t& stats) {
+    nlohmann::json result = {};
+    auto start = std::chrono::steady_clock::now();
+    nlohmann::json response;
+    if (url.starts_with("http://")) {
+        std::string body;
+        int code = co_await http_async_request(url, token, "POST", 
+            "/v1/chat/completions", request_body(req), body, 
+            std::chrono::seconds(600));
+        response = nlohmann::json::parse(body, nullptr, false);
+        if (code != 200) {
+            std::cerr << "Error during LLM generation: " << code << " " << 
+                body << std::endl;
+            co_return result;
+        }
+    } else {
+        co_await asio::post(*pool, asio::use_awaitable);
+        try {
+            if (req.contains("tools") && req["tools"].is_string()) {
+                req["tools"] = nlohmann::json::parse(
+                    req["tools"].get<std::string>());
+            }
+            response = openai::chat().create(req);
+        } catch(std::exception& e) {
+            std::cerr << "Error during LLM generation: " << e.what() << 
+                std::endl;
+        }
+        co_await asio::post(ctx, asio::use_awaitable);
+    }
+    if (!response.contains("choices") || !response["choices"].is_array() || 
+        response["choices"].empty()) co_return result;
+
+    result = response["choices"][0];
+    std::chrono::duration<float> elapsed = 
+        std::chrono::steady_clock::now() - start;
+    stats.ttft = elapsed.count();
+    if (response.contains("timings")) {
+        timings_stats(response["timings"], stats);
+        stats.ttft = response["timings"].value("prompt_ms", 
+            .0f) / 1000.0f;
+    }
+    co_return result;
+}
+
+/* same result shape as chat_create, deltas are forwarded to the stream
+   callback as they arrive. */
+asio::awaitable<nlohmann::json> LLM::chat_stream(std::string url, 
+    nlohmann::json req, llm_stats_t& stats, 
+    std::shared_ptr<llm_request_t> request) {
+    auto on_delta = request->handler.on_delta ? request->handler.on_delta : 
+        stream_func;
+    nlohmann::json message = {
+        {"role", "assistant"},
+        {"content", ""}
+    };
+    std::string reasoning_content = "";
+    std::string content = "";
+    think_parser_t think;           //<think> tags inlined in the content
+    std::string finish_reason = "";
+    nlohmann::json timings;
+
+    req["stream"] = true;
+    auto start = std::chrono::steady_clock::now();
+    auto first = start;
+    int n_tokens = 0;
+    int ret = co_await http_async_post_stream(url, token, 
+        "/v1/chat/completions", request_body(req), 
+        [&](const std::string& data) {
+        if (request->cancelled) return false;
+
+        nlohmann::json chunk = nlohmann::json::parse(data, 
+            nullptr, false);
+        if (chunk.is_discarded()) return true;
+        if (chunk.contains("timings")) timings = chunk["timings"];
+        if (!chunk.contains("choices") || 
+            chunk["choices"].empty()) return true;
+
+        auto& choice = chunk["choices"][0];
+        std::string reason = json_string(choice, "finish_reason");
+        if (reason.size() > 0) finish_reason = reason;
+        if (!choice.contains("delta")) return true;
+
+        auto& delta = choice["delta"];
+        std::string reason_delta = json_string(delta, 
+            "reasoning_content");
+        std::string content_delta = json_string(delta, "content");
+        if (reason_delta.size() > 0 || content_delta.size() > 0) {
+            if (n_tokens++ == 0) first = std::chrono::steady_clock::now();
+            std::string reason_out = reason_delta, content_out = "";
+            think.feed(content_delta, [&](bool reasoning, 
+                std::string_view span) {
+                (reasoning ? reason_out : content_out).append(span);
+            });
+            reasoning_content += reason_out;
+            content += content_out;
+            if (on_delta && (reason_out.size() > 0 || content_out.size() > 0)) {
+                on_delta(request->id, reason_out, content_out);
+            }
+        }
+
+        if (delta.contains("tool_calls") && 
+            delta["tool_calls"].is_array()) {
+            if (!message.contains("tool_calls")) {
+                message["tool_calls"] = nlohmann::json::array();
+            }
+            auto& tool_calls = message["tool_calls"];
+            for (auto const& tool: delta["tool_calls"]) {
+                if (!tool.is_object()) continue;
+                size_t index = tool.contains("index") && 
+                    tool["index"].is_number_unsigned() ? 
+                    tool["index"].get<size_t>() : 0;
+                while (tool_calls.size() <= index) {
+                    tool_calls.push_back({
+                        {"type", "function"},
+                        {"function", {{"name", ""}, {"arguments", ""}}}
+                    });
+                }
+                auto& call = tool_calls[index];
+                std::string id = json_string(tool, "id");
+                if (id.size() > 0) call["id"] = id;
+                if (tool.contains("function")) {
+                    auto& f = call["function"];
+                    f["name"] = f["name"].get<std::string>() + 
+                        json_string(tool["function"], "name");
+                    f["arguments"] = f["arguments"].get<std::string>() + 
+                        json_string(tool["function"], "arguments");
+                }
+            }
+        }
+        return true;
+    }, request->abort);
+    if (request->cancelled) finish_reason = "cancelled";
+    else if (ret != 0) co_return nlohmann::json{};
+    if (finish_reason.empty()) co_return nlohmann::json{};
+    /* a held back tag or leading whitespace is streamed like the rest */
+    think.finish([&](bool reasoning, std::string_view span) {
+        (reasoning ? reasoning_content : content).append(span);
+        if (on_delta && span.size() > 0) {
+            on_delta(request->id, reasoning ? std::string(span) : "", 
+                reasoning ? "" : std::string(span));
+        }
+    });
+    message["content"] = content;
+
+    auto end = std::chrono::steady_clock::now();
+    stats.ttft = std::chrono::duration<float>(first - start).count();
+    stats.n_tokens = n_tokens;
+    float decode = std::chrono::duration<float>(end - first).count();
+    if (decode > .0f) stats.tokens_per_second = n_tokens / decode;
+    timings_stats(timings, stats);
+
+    if (reasoning_content.size() > 0) {
+        message["reasoning_content"] = reasoning_content;
+    }
+    co_return nlohmann::json{
+        {"finish_reason", finish_reason},
+        {"message", message}
+    };
 }
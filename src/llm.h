@@ -1,13 +1,105 @@
 #pragma once
 
-#include <condition_variable>
+#include "cache.h"
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <nlohmann/json.hpp>
+#include <string>
 #include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+typedef struct _llm_stats_t {
+    std::string finish_reason = "";  //stop, length, cancelled, error
+    float ttft = .0f;               //seconds until the first token
+    float tokens_per_second = .0f;
+    int n_tokens = 0;
+    int n_prompt = 0;               //prompt tokens evaluated
+    int n_cached = 0;               //prompt tokens reused from the kv cache
+    int n_drafted = 0;              //speculative tokens from the draft model
+    int n_accepted = 0;             //of those, kept by the target
+    bool from_cache = false;        //replayed from the response cache
+} llm_stats_t;
+
+/* calls of one tool since init */
+typedef struct _llm_tool_stats_t {
+    int calls = 0;
+    int timeouts = 0;
+    float total_ms = .0f;           //every call that returned, late or not
+    float max_ms = .0f;
+} llm_tool_stats_t;
+
+/* request id, content, stats */
+typedef std::function<void (int, const std::string&, const llm_stats_t&)> llama_generate_callback;
+/* streaming deltas: request id, reasoning, content */
+typedef std::function<void (int, const std::string&, const std::string&)> llama_stream_callback;
+/* one tool call on the tool pool. the llm cancels it at its deadline or
+   with its request, a tool that waits on something hands on_cancel the
+   way to stop waiting so the worker is freed. */
+typedef struct _llm_tool_call_t {
+    nlohmann::json call;            //the tool_calls entry of the reply
+    std::atomic<bool> cancelled = false;
+    /* the llm stops waiting for the result then */
+    std::chrono::steady_clock::time_point deadline = 
+        std::chrono::steady_clock::time_point::max();
+
+    /* abort runs at once if the call is cancelled already */
+    void on_cancel(std::function<void ()> abort) {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (!cancelled) {
+                this->abort = std::move(abort);
+                return;
+            }
+        }
+        if (abort) abort();
+    }
+
+    void cancel() {
+        std::function<void ()> f;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (cancelled.exchange(true)) return;
+            f = std::move(abort);
+        }
+        if (f) f();
+    }
+
+private:
+    std::mutex mtx;
+    std::function<void ()> abort;
+} llm_tool_call_t;
+typedef std::function<std::string (std::shared_ptr<llm_tool_call_t>)> 
+    llama_tool_callback;
+/* embeddings in input order, empty if the request failed */
+typedef std::function<void (const std::vector<std::vector<float>>&)> llm_embed_callback;
+/* token count, -1 if the request failed */
+typedef std::function<void (int)> llm_tokenize_callback;
+
+/* the server of a model. acquire calls back from any thread with its base
+   url, "" if there is none, and the id of the server. every url handed out
+   is given back with release of that id once the request is done with it,
+   with what it generated. */
+typedef struct _llm_router_t {
+    std::function<void (const std::string&, 
+        std::function<void (const std::string&, int)>)> acquire;
+    std::function<void (int, const llm_stats_t&)> release;
+} llm_router_t;
+
+/* per request callbacks, empty members fall back to the ones given to init */
+typedef struct _llm_handler_t {
+    llama_generate_callback on_done;
+    llama_stream_callback on_delta;
+} llm_handler_t;
 
-typedef std::function<void (const std::string&)> llama_generate_callback;
-typedef std::function<std::string (const nlohmann::json&)> llama_tool_callback;
 class LLM {
 public:
     static LLM& instance() {
@@ -18,15 +110,48 @@ public:
     LLM(const LLM&) = delete;
     LLM& operator=(const LLM&) = delete;
 
+    typedef enum {
+        low = 0,
+        normal,
+        high
+    } enuLLMPriority;
+
     int init(const nlohmann::json& config, llama_generate_callback func, 
+        llama_stream_callback stream_func, 
         llama_tool_callback tool_func, 
         const bool verbos = false);
     int shutdown();
-    int generate(const nlohmann::json& req);
+    /* queue a chat completion, returns the request id, id if one was
+       reserved for it. "tools" is either the array or the array already
+       serialized into a string. */
+    int generate(const nlohmann::json& req, int priority = normal, 
+        llm_handler_t handler = {}, int id = 0);
+    /* drop a queued request or stop an in-flight one */
+    bool cancel(int id);
+    /* embed a batch of texts, doesn't take a chat slot */
+    void embed(const std::vector<std::string>& inputs, 
+        llm_embed_callback on_done);
+    /* count the tokens of content with the model's tokenizer */
+    void tokenize(const std::string& content, llm_tokenize_callback on_done);
+    /* id for work that reports through the llm callbacks before it has
+       a request of its own */
+    int reserve_id();
+    /* check /health now instead of at the next poll, after the server
+       was started or went down */
+    void recheck();
+    /* send chat requests to the server of their "model" instead of
+       base_url, set before the first request */
+    void route(llm_router_t router) { this->router = std::move(router); };
+
+    std::unordered_map<std::string, llm_tool_stats_t> tool_stats();
+    /* hits and lookups of the response cache, false if it is off */
+    bool cache_stats(int& hits, int& lookups) const;
 
     std::string llm_base_url() { return base_url; };
-    bool llm_idle() const { return (status == idle); };
+    bool llm_idle() const { return llm_running() && (pending == 0); };
     bool llm_running() const { return !(status == none); };
+    int llm_pending() const { return pending; };
+    int llm_slots() const { return n_slots; };
 
 private:
     LLM() = default;
@@ -34,17 +159,71 @@ private:
 
     typedef enum {
         none = 0,
-        idle,
-        busy
+        idle
     } enuLLMStatus;
 
+    typedef struct _llm_request_t {
+        int id = 0;
+        int priority = normal;
+        nlohmann::json body;
+        llm_handler_t handler;
+        std::atomic<bool> cancelled = false;
+        std::function<void ()> abort;  //only touched on the io thread
+    } llm_request_t;
+
+    /* everything below runs on the io thread */
+    void dispatch();
+    boost::asio::awaitable<void> serve(std::shared_ptr<llm_request_t> request);
+    boost::asio::awaitable<void> health_monitor();
+    boost::asio::awaitable<bool> health_check();
+    boost::asio::awaitable<void> embedding(std::vector<std::string> inputs, 
+        llm_embed_callback on_done);
+    /* results in call order, timed out calls answer with an error */
+    boost::asio::awaitable<std::vector<std::string>> call_tools(
+        const std::vector<nlohmann::json>& tool_calls, 
+        std::shared_ptr<llm_request_t> request);
+    boost::asio::awaitable<void> tokenization(std::string content, 
+        llm_tokenize_callback on_done);
+    /* the url and the id of the server, "" and 0 for none */
+    boost::asio::awaitable<std::pair<std::string, int>> backend(
+        std::string model, std::shared_ptr<llm_request_t> request);
+    boost::asio::awaitable<nlohmann::json> chat_stream(std::string url, 
+        nlohmann::json req, llm_stats_t& stats, 
+        std::shared_ptr<llm_request_t> request);
+    boost::asio::awaitable<nlohmann::json> chat_create(std::string url, 
+        nlohmann::json req, llm_stats_t& stats);
+
     std::string base_url = "";
+    std::string token = "";
+    std::string embedding_url = "";
+    bool stream = true;
+    int n_slots = 1;
+    std::chrono::milliseconds tool_timeout{30000};
+    std::unordered_map<std::string, std::chrono::milliseconds> tool_timeouts;
+
+    llama_generate_callback generate_func;
+    llama_stream_callback stream_func;
+    llama_tool_callback tool_func;
+    llm_router_t router;
+    ResponseCache cache;
 
+    /* io thread: health monitor, dispatch and response handling.
+       pool: openai requests and cache writes. tool_pool: tool calls, a
+       tool that hangs past its timeout only holds up one of these. */
+    boost::asio::io_context ctx;
+    boost::asio::steady_timer health_timer{ctx};
+    std::unique_ptr<boost::asio::thread_pool> pool;
+    std::unique_ptr<boost::asio::thread_pool> tool_pool;
     std::thread llama_thread;
-    enuLLMStatus status = none;
-    bool llama_thread_running = false;
+    std::atomic<enuLLMStatus> status = none;
+    std::atomic<bool> llama_thread_running = false;
+    std::atomic<int> pending = 0;
 
-    nlohmann::json request;
+    int next_id = 1;
+    int active = 0;
+    /* ordered by priority, then by arrival */
+    std::vector<std::shared_ptr<llm_request_t>> requests;
+    std::unordered_map<int, std::shared_ptr<llm_request_t>> running;
+    std::unordered_map<std::string, llm_tool_stats_t> tools;
     std::mutex mtx;
-    std::condition_variable cv;
-};
\ No newline at end of file
+};
@@ -1,6 +1,9 @@
-#include "utf8/checked.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cfloat>
+#include <climits>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <boost/program_options.hpp>
@@ -8,6 +11,7 @@
 #include <nlohmann/json_fwd.hpp>
 #include <string>
 #include <nlohmann/json.hpp>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -20,16 +24,42 @@
 #include "imgui_freetype.h"
 #include "ImGuiFileDialog.h"
 #include "fpdfview.h"
-#include "fpdf_text.h"
 
 #include "server.h"
 #include "llm.h"
+#include "batch.h"
+#include "document.h"
+#include "conversation.h"
+#include "journal.h"
 #include "message.h"
 #include "tools.h"
+#include "wrap.h"
 
 static Server& server = Server::instance();
 static LLM& llm = LLM::instance();
+static Document& document = Document::instance();
 static LLMTools& llmtools = LLMTools::instance();
+static Journal& journal = Journal::instance();
+static Batch& batch = Batch::instance();
+
+/* layout of the messages view. heights are measured when a message is
+   drawn and estimated until then, all of them are dropped when the wrap
+   width changes or old messages are dropped. a new snapshot only
+   measures the messages that changed, while streaming the last one, and
+   offsets are summed again from the first change on. */
+typedef struct _chat_view_t {
+    chat_snapshot_t messages;
+    float width = .0f;
+    std::vector<float> heights;     //of every message in messages
+    std::vector<float> offsets;     //top of every message, then the end
+    size_t dirty = 0;               //offsets from here on are out of date
+} chat_view_t;
+
+typedef struct _token_count_t {
+    std::atomic<int> count = 0;
+    std::atomic<bool> counting = false;
+    bool dirty = false;             //edited since the last count started
+} token_count_t;
 
 typedef struct _user_state_t {
     //style
@@ -43,22 +73,50 @@ typedef struct _user_state_t {
 
     //messages view
     chat_messages_t chat_messages;
+    chat_view_t chat_view;
+    Conversation conversation;
 
+    std::string input = "";         //message editor, grown by ImGui
+    TextWrap wrap;
+    token_count_t input_tokens;
     ImVec2 current_cursor_pos{.0f, .0f};
     std::string edit_message = "";
 
+    //frame pacing
+    uint32_t wakeup_event = 0;
+    std::atomic<bool> wakeup_pending = false;
+    int idle_ms = 500;              //redraw period without events
+
+    //in-flight requests
+    std::atomic<int> chat_request_id = 0;
+    std::atomic<int> file_request_id = 0;
+
     //config
     std::string model = "Qwen3-8B-Q4_K_M";
     float temperature = 0.6f;
     float top_p = 0.95f;
     int top_k = 20;
     float presence_penalty = 1.5f;
+    int seed = -1;                  //-1 for a random seed per request
     std::string system_prompt = "";
 } user_state_t;
 static user_state_t user_state;
 
+/* redraw from another thread. wakeups are merged until the main loop
+   takes the event. */
+static void ui_wakeup() {
+    if (user_state.wakeup_event == 0 || 
+        user_state.wakeup_pending.exchange(true)) return;
+    SDL_Event ev;
+    SDL_zero(ev);
+    ev.type = user_state.wakeup_event;
+    SDL_PushEvent(&ev);
+}
+
 SDL_Window * ui_create(const nlohmann::json& config) {
     if (!SDL_Init(SDL_INIT_VIDEO)) { return nullptr; }
+    user_state.wakeup_event = SDL_RegisterEvents(1);
+    user_state.idle_ms = std::max(10, config.value("idle_ms", 500));
     
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, 
         SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG);
@@ -113,26 +171,29 @@ SDL_Window * ui_create(const nlohmann::json& config) {
     auto font_addition = config_fonts.value("addition", 
         std::vector<nlohmann::json>{});
 
+    /* no glyph ranges: the atlas grows with the glyphs that are actually
+       drawn, the merged fonts are only asked for codepoints the ones
+       before them lack */
+    auto fonts_start = std::chrono::steady_clock::now();
     ImFontConfig fc;
     fc.MergeMode = false;
     io.Fonts->AddFontFromFileTTF(font_default.c_str(), 
-        font_size, &fc, 
-        io.Fonts->GetGlyphRangesDefault());
+        font_size, &fc);
     
     for (auto const& font: font_addition) {
         fc.MergeMode = true;
         if (font["language"] == "chinese") {
             io.Fonts->AddFontFromFileTTF(font["file"].get<std::string>().c_str(), 
-            font_size, &fc, 
-            io.Fonts->GetGlyphRangesChineseFull());
+            font_size, &fc);
         } else if (font["language"] == "emoji") {
-            ImWchar ranges[] = {0x1, 0x1FFFF, 0x0};
             fc.FontLoaderFlags |= ImGuiFreeTypeLoaderFlags_LoadColor;
             io.Fonts->AddFontFromFileTTF(font["file"].get<std::string>().c_str(), 
-            font_size, &fc, 
-            ranges);
+            font_size, &fc);
         }
     }
+    std::cout << std::format("fonts loaded in {:.1f} ms\n", 
+        std::chrono::duration<float, std::milli>(
+            std::chrono::steady_clock::now() - fonts_start).count());
 
     ImGui::GetStyle().FrameRounding = user_state.rounding;
     
@@ -151,6 +212,107 @@ static auto box = [](const char * title, const ImVec2& pos,
     ImGui::End();
 };
 
+static void chat_message(const chat_message_t& message, uint64_t seq) {
+    if (message._paged) {
+        ImGui::TextDisabled("...");
+        ImGui::Spacing();ImGui::Spacing();
+        return;
+    }
+    ImGui::Text("%s", message._time.c_str());
+    if (message._role == "user") {
+        ImGui::TextWrapped("%s", message._content.c_str());
+    } else {
+        if (message._reason.size() > 0) {
+            ImGui::PushStyleColor(ImGuiCol_Header, 
+                {0.f, 0.f, 0.f, 1.f});
+            ImGui::PushStyleColor(ImGuiCol_HeaderActive, 
+                {0.f, 0.f, 0.f, 1.f});
+            ImGui::PushStyleColor(ImGuiCol_HeaderHovered, 
+                {0.f, 0.f, 0.f, 1.f});
+            ImGui::PushStyleColor(ImGuiCol_Text, 
+                {1.0f, 0.7f, 0.8f, 1.0f});
+            std::string label = std::format("think##{}", seq);
+            if (ImGui::CollapsingHeader(label.c_str())) {
+                ImGui::TextWrapped("%s", message._reason.c_str());
+            }
+            ImGui::PopStyleColor(4);
+        }
+
+        if (message._content.size() > 0) {
+            ImGui::PushStyleColor(ImGuiCol_Text, 
+                {0.9f, 0.5f, 0.5f, 1.0f});
+            ImGui::TextWrapped("%s", message._content.c_str());
+            ImGui::PopStyleColor();
+        }
+
+        if (message._from_cache) {
+            ImGui::TextDisabled("from the response cache");
+        } else if (message._tokens_per_second > .0f) {
+            ImGui::TextDisabled("ttft: %.2fs, %.1f tokens/s, "
+                "prompt: %d cached / %d", 
+                message._ttft, message._tokens_per_second, 
+                message._n_cached, 
+                message._n_cached + message._n_prompt);
+            if (message._n_drafted > 0) {
+                ImGui::SameLine();
+                ImGui::TextDisabled("draft: %d/%d accepted", 
+                    message._n_accepted, message._n_drafted);
+            }
+        }
+    }
+    ImGui::Spacing();ImGui::Spacing();
+}
+
+/* height of chat_message with the think header collapsed */
+static float chat_message_height(const chat_message_t& message, 
+    float width) {
+    const ImGuiStyle& style = ImGui::GetStyle();
+    auto wrapped = [&](const std::string& s) {
+        return ImGui::CalcTextSize(s.c_str(), s.c_str() + s.size(), 
+            false, width).y + style.ItemSpacing.y;
+    };
+    float line = ImGui::GetTextLineHeightWithSpacing();
+    float height = line + 2 * style.ItemSpacing.y;
+    if (message._paged) return height;
+    if (message._role == "user") return height + wrapped(message._content);
+    if (message._reason.size() > 0) 
+        height += ImGui::GetFrameHeightWithSpacing();
+    if (message._content.size() > 0) height += wrapped(message._content);
+    if (message._tokens_per_second > .0f) height += line;
+    return height;
+}
+
+static void chat_layout(chat_view_t& view, const chat_snapshot_t& messages, 
+    float width) {
+    size_t n = messages->size();
+    if (width != view.width || (view.messages && 
+        view.messages->first != messages->first)) {
+        view.width = width;
+        view.messages.reset();
+    }
+    if (messages != view.messages) {
+        /* a message that is the same object kept its height */
+        const chat_history_t * old = view.messages.get();
+        size_t keep = old ? messages->shared_prefix(*old) : 0;
+        size_t n_old = old ? old->size() : 0;
+        view.heights.resize(n);
+        for (size_t i=keep; i<n; ++i) {
+            if (i < n_old && &(*old)[i] == &(*messages)[i]) continue;
+            view.heights[i] = chat_message_height((*messages)[i], width);
+        }
+        view.messages = messages;
+        view.dirty = old ? std::min(view.dirty, keep) : 0;
+    }
+    if (view.dirty >= n && view.offsets.size() == n + 1) return;
+
+    view.offsets.resize(n + 1);
+    view.offsets[0] = .0f;
+    for (size_t i=view.dirty; i<n; ++i) {
+        view.offsets[i + 1] = view.offsets[i] + view.heights[i];
+    }
+    view.dirty = n;
+}
+
 static auto chat_messages = [](const ImVec2& pos, 
         const ImVec2& size) {
     box("chat messages", pos, size, [](const char * title){
@@ -158,39 +320,41 @@ static auto chat_messages = [](const ImVec2& pos,
         ImGui::BeginChild("##messages", {0, 0}, 
             0, 
             ImGuiWindowFlags_AlwaysVerticalScrollbar);
-        std::vector<chat_message_t> messages = 
-            user_state.chat_messages.snapshot();
-        for (int i=0; i<messages.size(); ++i) {
-            auto const& message = messages[i];
-            ImGui::Text("%s", message._time.c_str());
-            if (message._role == "user") {
-                ImGui::TextWrapped("%s", message._content.c_str());
-            } else {
-                if (message._reason.size() > 0) {
-                    ImGui::PushStyleColor(ImGuiCol_Header, 
-                        {0.f, 0.f, 0.f, 1.f});
-                    ImGui::PushStyleColor(ImGuiCol_HeaderActive, 
-                        {0.f, 0.f, 0.f, 1.f});
-                    ImGui::PushStyleColor(ImGuiCol_HeaderHovered, 
-                        {0.f, 0.f, 0.f, 1.f});
-                    ImGui::PushStyleColor(ImGuiCol_Text, 
-                        {1.0f, 0.7f, 0.8f, 1.0f});
-                    std::string label = std::format("think##{}", i);
-                    if (ImGui::CollapsingHeader(label.c_str())) {
-                        ImGui::TextWrapped("%s", message._reason.c_str());
-                    }
-                    ImGui::PopStyleColor(4);
-                }
-
-                if (message._content.size() > 0) {
-                    ImGui::PushStyleColor(ImGuiCol_Text, 
-                        {0.9f, 0.5f, 0.5f, 1.0f});
-                    ImGui::TextWrapped("%s", message._content.c_str());
-                    ImGui::PopStyleColor();
-                }
+        chat_view_t& view = user_state.chat_view;
+        chat_snapshot_t messages = user_state.chat_messages.snapshot();
+        chat_layout(view, messages, ImGui::GetContentRegionAvail().x);
+
+        /* messages differ in height, so the visible range is searched in
+           the offsets instead of ImGuiListClipper's fixed item height */
+        auto const& offsets = view.offsets;
+        float top = ImGui::GetCursorPosY();
+        float visible_y = ImGui::GetScrollY() - top;
+        int first = std::upper_bound(offsets.begin(), offsets.end(), 
+            visible_y) - offsets.begin() - 1;
+        int last = std::lower_bound(offsets.begin(), offsets.end(), 
+            visible_y + ImGui::GetWindowHeight()) - offsets.begin();
+        first = std::clamp(first, 0, int(messages->size()));
+        last = std::clamp(last, first, int(messages->size()));
+
+        /* journal messages are decoded once they come into view, they are
+           drawn from the next snapshot */
+        if (user_state.chat_messages.page(messages->seq(first), 
+            messages->seq(last))) ui_wakeup();
+
+        ImGui::SetCursorPosY(top + offsets[first]);
+        for (int i=first; i<last; ++i) {
+            float y = ImGui::GetCursorPosY();
+            chat_message((*messages)[i], messages->seq(i));
+            float height = ImGui::GetCursorPosY() - y;
+            float& cached = view.heights[i];
+            if (cached != height) {
+                cached = height;
+                view.dirty = std::min<size_t>(view.dirty, i);
             }
-            ImGui::Spacing();ImGui::Spacing();
         }
+        ImGui::SetCursorPosY(ImGui::GetCursorPosY() + 
+            offsets.back() - offsets[last]);
+        ImGui::Dummy({.0f, .0f});
 
         float scroll_y = ImGui::GetScrollY();
         float scroll_max_y = ImGui::GetScrollMaxY();
@@ -201,51 +365,6 @@ static auto chat_messages = [](const ImVec2& pos,
     });
 };
 
-std::vector<std::string> split_words(const std::string& s) {
-    const int max_word_len = 16;
-    std::vector<std::string> words;
-    std::istringstream iss(s);
-    std::string word;
-
-    auto push_word = [&]() {
-        if (word.size() > 0) {
-            words.push_back(word);
-            word.clear();
-        }
-    };
-
-    while (!iss.eof()) {
-        char c = (char)iss.peek();
-        if ((c & 0x80) == 0x00) { //1
-            iss.read(&c, 1); word.push_back(c);
-            if (c == ' ' || word.size() > max_word_len) {
-                push_word();
-            }
-        } else if ((c & 0xe0) == 0xc0) { //2
-            push_word();
-            word.assign(2, 0x00);
-            iss.read(word.data(), 2);
-            push_word();
-        } else if ((c & 0xf0) == 0xe0) { //3
-            push_word();
-            word.assign(3, 0x00);
-            iss.read(word.data(), 3);
-            push_word();
-        } else if ((c & 0xf8) == 0xf0) { //4
-            push_word();
-            word.assign(4, 0x00);
-            iss.read(word.data(), 4);
-            push_word();
-        } else {
-            push_word();
-            iss.read(&c, 1);
-        }
-    }
-    push_word();
-
-    return words;
-}
-
 static auto restore_string = [](const char * s) {
     std::string buffer;
     const char * start = s;
@@ -259,72 +378,60 @@ static auto restore_string = [](const char * s) {
 };
 
 static int chat_message_edit_callback(ImGuiInputTextCallbackData * data) {
-    if (data->EventFlag == ImGuiInputTextFlags_CallbackEdit) {
-        int max_width = ImGui::GetItemRectSize().x - ImGui::CalcTextSize(" \n").x;
-        std::string buffer = restore_string(data->Buf);
-        std::istringstream iss(buffer);
-        std::ostringstream oss;
-        bool dirty = false;
-        bool at_end = (data->CursorPos == data->BufTextLen);
-
-        for (std::string line; std::getline(iss, line);) {
-            int width = ImGui::CalcTextSize(line.c_str()).x;
-            if (width > max_width) {
-                std::vector<std::string> words = split_words(line);
-                std::string s, new_line;
-                width = 0;
-                for (auto const& word: words) {
-                    int word_width = ImGui::CalcTextSize(word.c_str()).x;
-                    width += word_width;
-                    if (width >= max_width) {
-                        if (new_line.size() > 0) new_line += " \n";
-                        new_line += s;
-                        s.clear();
-                        width = word_width;
-                    }
-                    s += word;
-                }
-                if (s.size() > 0) {
-                    if (new_line.size() > 0) new_line += " \n";
-                    new_line += s;
-                }
-                if (oss.str().size() > 0) oss << std::endl;
-                oss << new_line;
-                dirty = true;
-                continue;
-            }
-            if (oss.str().size() > 0) oss << std::endl;
-            oss << line;
-        }
-        if (buffer.back() == '\n') oss << std::endl;
-
-        if (dirty) {
-            strcpy(data->Buf, oss.str().c_str());
-            data->BufTextLen = strlen(data->Buf);
-            if (at_end) data->CursorPos = data->BufTextLen;
-            data->BufDirty = dirty;
-        }
+    if (data->EventFlag == ImGuiInputTextFlags_CallbackResize) {
+        std::string * input = static_cast<std::string *>(data->UserData);
+        input->resize(data->BufTextLen);
+        data->Buf = input->data();
+        return 0;
     }
 
-    std::string buffer(data->Buf);
-    buffer = buffer.substr(0, data->CursorPos);
-    ImVec2 size = ImGui::CalcTextSize(buffer.c_str());
-    ImVec2 line_size = size;
-    int n_lines = std::count(buffer.begin(), 
-        buffer.end(), '\n');
-    if (n_lines > 0) {
-        buffer = buffer.substr(buffer.rfind("\n") + 1);
-        line_size = ImGui::CalcTextSize(buffer.c_str());
+    TextWrap& wrap = user_state.wrap;
+    float max_width = ImGui::GetItemRectSize().x - 
+        ImGui::CalcTextSize(" \n").x;
+    if (data->EventFlag == ImGuiInputTextFlags_CallbackEdit || 
+        wrap.resized(max_width)) {
+        wrap.edit(data, max_width);
     }
+
+    ImVec2 offset = wrap.cursor({data->Buf, size_t(data->BufTextLen)}, 
+        data->CursorPos);
     ImVec2 pos = ImGui::GetCursorScreenPos();
-    user_state.current_cursor_pos = {
-        pos.x + line_size.x, 
-        pos.y + size.y - line_size.y
-    };
+    user_state.current_cursor_pos = {pos.x + offset.x, pos.y + offset.y};
 
     return 0;
 }
 
+/* recount the editor text on the server, one request at a time. the count
+   stays on the last result until the next one is in. */
+static void count_input_tokens() {
+    token_count_t& tokens = user_state.input_tokens;
+    if (!tokens.dirty || tokens.counting) return;
+    tokens.dirty = false;
+    if (user_state.input.empty() || !llm.llm_running()) {
+        tokens.count = 0;
+        return;
+    }
+    tokens.counting = true;
+    llm.tokenize(restore_string(user_state.input.c_str()), [](int n) {
+        user_state.input_tokens.count = n;
+        user_state.input_tokens.counting = false;
+        ui_wakeup();
+    });
+}
+
+static void show_input_tokens() {
+    int n = user_state.input_tokens.count;
+    if (user_state.input.empty() || n <= 0) return;
+    std::string label = std::format("{} tokens", n);
+    const ImGuiStyle& style = ImGui::GetStyle();
+    ImVec2 max = ImGui::GetItemRectMax();
+    ImVec2 text = ImGui::CalcTextSize(label.c_str());
+    ImGui::GetWindowDrawList()->AddText({
+            max.x - text.x - style.ScrollbarSize - style.FramePadding.x, 
+            max.y - text.y - style.FramePadding.y
+        }, ImGui::GetColorU32(ImGuiCol_TextDisabled), label.c_str());
+}
+
 static auto show_edit_message = []() {
     if (!user_state.edit_message.size()) return;
     ImDrawList * draw_list = ImGui::GetForegroundDrawList();
@@ -341,7 +448,8 @@ static auto chat_message = [](const ImVec2& pos,
         const ImVec2& size) {
     box("chat message", pos, size, [](const char * title){
         (void)title;
-        ImGui::BeginDisabled(!llm.llm_idle());
+        ImGui::BeginDisabled(!llm.llm_running() || !server.accepting() || 
+            user_state.chat_request_id != 0);
         
         if (user_state.current_cursor_pos.x == .0f && 
             user_state.current_cursor_pos.y == .0f) {
@@ -351,53 +459,56 @@ static auto chat_message = [](const ImVec2& pos,
         ImVec2 size = ImGui::GetContentRegionAvail();
         ImGui::PushStyleColor(ImGuiCol_FrameBg, 
             {0.8f, 0.8f, 0.8f, 0.2f});
-        char buf[2 * 1024] = {0x0};
+        std::string& input = user_state.input;
         ImGuiInputTextFlags flags = ImGuiInputTextFlags_EnterReturnsTrue;
         flags |= ImGuiInputTextFlags_CtrlEnterForNewLine;
         flags |= ImGuiInputTextFlags_NoHorizontalScroll;
         flags |= ImGuiInputTextFlags_CallbackAlways;
         flags |= ImGuiInputTextFlags_CallbackEdit;
-        if (ImGui::InputTextMultiline("##message", buf, IM_ARRAYSIZE(buf), 
-            {size.x - 20, size.y}, flags, chat_message_edit_callback)) {
-            if (strlen(buf) > 0) {
+        flags |= ImGuiInputTextFlags_CallbackResize;
+        bool entered = ImGui::InputTextMultiline("##message", input.data(), 
+            input.capacity() + 1, {size.x - 40, size.y}, flags, 
+            chat_message_edit_callback, &input);
+        if (ImGui::IsItemEdited()) {
+            input.resize(std::strlen(input.c_str()));
+            user_state.input_tokens.dirty = true;
+        }
+        count_input_tokens();
+        if (entered) {
+            if (input.size() > 0) {
+                std::string content = restore_string(input.c_str());
                 nlohmann::json request;
                 request["model"] = user_state.model;
                 request["temperature"] = user_state.temperature;
                 request["top_p"] = user_state.top_p;
                 request["top_k"] = user_state.top_k;
                 request["presence_penalty"] = user_state.presence_penalty;
+                if (user_state.seed >= 0) request["seed"] = user_state.seed;
                 request["messages"] = {
                     {{"role", "system"}, 
-                        {"content", user_state.system_prompt}},
-                    {{"role", "user"}, 
-                        {"content", restore_string(buf)}}
+                        {"content", user_state.system_prompt}}
                 };
 
-                std::vector<nlohmann::json> tools;
-                for (int i=0; i<user_state.tool_names.size(); ++i) {
-                    if (user_state.tool_status[i]) {
-                        std::string name = user_state.tool_names[i];
-                        nlohmann::json tool = {
-                            {"type", "function"},
-                            {"function", {
-                                {"name", llmtools[name]["name"]},
-                                {"description", llmtools[name]["description"]},
-                                {"parameters", llmtools[name]["parameters"]}
-                            }}
-                        };
-                        tools.push_back(tool);
-                    }
-                }
-                if (tools.size() > 0) request["tools"] = tools;
-                llm.generate(request);
+                auto tools = llmtools.tools(user_state.tool_status);
+                if (tools.size() > 0) request["tools"] = std::move(tools);
 
-                chat_message_t message{"user", buf};
+                /* a cached answer can finish before ask returns, the id
+                   and the question are in place before it is sent */
+                chat_message_t message{"user", content};
                 user_state.chat_messages.push(message);
-                buf[0] = '\0';
+                int id = llm.reserve_id();
+                user_state.chat_request_id = id;
+                document.ask(request, content, &user_state.conversation, 
+                    {}, id);
+                input.clear();
+                user_state.wrap.clear();
+                user_state.input_tokens.dirty = true;
             }
         }
+        show_input_tokens();
         ImGui::PopStyleColor();
         ImGui::SameLine();
+        ImGui::BeginDisabled(document.loading());
         if (ImGui::Button("+")) {
             IGFD::FileDialogConfig config;
             config.path = ".";
@@ -409,6 +520,16 @@ static auto chat_message = [](const ImVec2& pos,
                 "Choose a file", ".pdf,.txt", config);
         }
         ImGui::EndDisabled();
+        ImGui::EndDisabled();
+
+        int request_id = user_state.chat_request_id;
+        if (request_id == 0) request_id = user_state.file_request_id;
+        if (request_id != 0) {
+            ImGui::SameLine();
+            if (ImGui::Button("x") && !document.cancel(request_id)) {
+                llm.cancel(request_id);
+            }
+        }
         show_edit_message();
     });
 };
@@ -463,25 +584,188 @@ static void help_marker(const char * id, const char * desc) {
 }
 
 static auto tab_tools = [](int width) {
+    /* mcp servers add their tools as they connect, ids never change */
+    if (llmtools.size() != user_state.tool_names.size()) {
+        user_state.tool_names = llmtools.names();
+        user_state.tool_status.resize(user_state.tool_names.size(), false);
+    }
     if (ImGui::BeginChild("##tools")) {
+        if (llmtools.connecting() > 0) {
+            ImGui::TextDisabled("connecting to %d mcp servers", 
+                llmtools.connecting());
+        }
+        auto stats = llm.tool_stats();
         for (int i=0; i<user_state.tool_names.size(); ++i) {
             std::string name = user_state.tool_names[i];
-            std::string desc = llmtools[name].dump('\t');
+            std::string desc = llmtools[i].dump('\t');
             ImGui::Checkbox(name.c_str(), 
                 reinterpret_cast<bool *>(&user_state.tool_status[i]));
             ImGui::SameLine();
             help_marker(name.c_str(), desc.c_str());
+            auto it = stats.find(name);
+            if (it == stats.end()) continue;
+            auto const& s = it->second;
+            ImGui::SameLine();
+            ImGui::TextDisabled(
+                "%d calls, avg %.0f ms, max %.0f ms, %d timeouts", s.calls, 
+                s.calls > 0 ? s.total_ms / s.calls : .0f, s.max_ms, 
+                s.timeouts);
         }
         ImGui::EndChild();
     }
 };
 
+/* the messages of a session are read from the journal as they scroll in */
+static void open_session(const std::string& name) {
+    size_t n = journal.open(name, user_state.chat_messages.max_size);
+    user_state.chat_messages.load(n, [](size_t i, chat_message_t& message) {
+        return journal.read(i, message);
+    });
+}
+
+/* switching sessions waits for the answer in flight, it belongs to the
+   current one */
+static void session() {
+    static std::vector<std::string> names;
+    std::string current = journal.session();
+    ImGui::Text("Session:");
+    ImGui::SameLine();
+    ImGui::BeginDisabled(user_state.chat_request_id != 0 || 
+        user_state.file_request_id != 0);
+    ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
+    std::string selected = "";
+    if (ImGui::BeginCombo("##sessions", current.c_str())) {
+        if (ImGui::IsWindowAppearing()) names = journal.sessions();
+        for (auto const& name: names) {
+            bool is_selected = (name == current);
+            if (ImGui::Selectable(name.c_str(), is_selected)) {
+                selected = name;
+            }
+            if (is_selected) ImGui::SetItemDefaultFocus();
+        }
+        ImGui::Separator();
+        if (ImGui::Selectable("new session")) {
+            std::time_t t = std::time(nullptr);
+            std::ostringstream oss;
+            oss << std::put_time(std::localtime(&t), "%Y%m%d-%H%M%S");
+            selected = oss.str();
+        }
+        ImGui::EndCombo();
+    }
+    ImGui::EndDisabled();
+
+    if (selected.size() > 0 && selected != current) {
+        open_session(selected);
+        user_state.conversation.clear();
+    }
+}
+
+/* the llama-servers we started, one per loaded model, with the tail of
+   their logs */
+static void server_status() {
+    static const char * names[] = {
+        "off", "loading", "ready", "restarting", "failed"
+    };
+    for (auto const& info: server.instances()) {
+        ImGui::PushID(info.model.c_str());
+        ImGui::Text("%s :%d %s", info.model.c_str(), info.port, 
+            names[info.status]);
+        if (info.draft.size() > 0) {
+            ImGui::SameLine();
+            ImGui::TextDisabled("+ %s", info.draft.c_str());
+        }
+        if (info.status == server_ready) {
+            ImGui::SameLine();
+            ImGui::TextDisabled("load %.1f s, %d busy", info.load_seconds, 
+                info.busy);
+        }
+        if (info.restarts > 0) {
+            ImGui::SameLine();
+            ImGui::TextDisabled("restarts %d, exit %d", info.restarts, 
+                info.exit_code);
+        }
+        ImGui::SameLine();
+        if (ImGui::SmallButton("log")) ImGui::OpenPopup("##server_log");
+        if (ImGui::BeginPopup("##server_log")) {
+            if (ImGui::BeginChild("##lines", {600, 300})) {
+                for (auto const& line: server.log(info.model)) {
+                    ImGui::TextUnformatted(line.c_str());
+                }
+                if (ImGui::IsWindowAppearing()) ImGui::SetScrollHereY(1.0f);
+                ImGui::EndChild();
+            }
+            ImGui::EndPopup();
+        }
+        ImGui::PopID();
+    }
+
+    /* tokens/s is what the user sees, drafted tokens included */
+    auto pairings = server.pairings();
+    if (pairings.empty() || !ImGui::TreeNode("Pairings")) return;
+    ImGuiTableFlags flags = ImGuiTableFlags_Borders | 
+        ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit;
+    if (ImGui::BeginTable("##pairings", 5, flags)) {
+        ImGui::TableSetupColumn("model");
+        ImGui::TableSetupColumn("draft");
+        ImGui::TableSetupColumn("requests");
+        ImGui::TableSetupColumn("tokens/s");
+        ImGui::TableSetupColumn("accepted");
+        ImGui::TableHeadersRow();
+        for (auto const& p: pairings) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(p.model.c_str());
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(p.draft.empty() ? "-" : p.draft.c_str());
+            ImGui::TableNextColumn();
+            ImGui::Text("%d", p.requests);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f", p.usage.seconds > .0f ? 
+                p.usage.n_tokens / p.usage.seconds : .0f);
+            ImGui::TableNextColumn();
+            if (p.usage.n_drafted > 0) {
+                ImGui::Text("%.0f%%", 100.0f * p.usage.n_accepted / 
+                    p.usage.n_drafted);
+            } else {
+                ImGui::TextUnformatted("-");
+            }
+        }
+        ImGui::EndTable();
+    }
+    ImGui::TreePop();
+}
+
 static auto llama = [](const ImVec2& pos, 
         const ImVec2& size) {
     box("llm", pos, size, [](const char * title){
         ImGui::SeparatorText(title);
 
         ImGui::Text("Server: %s", llm.llm_base_url().c_str());
+        if (server.managed()) server_status();
+        ImGui::Text("Slots: %d, pending: %d", llm.llm_slots(), 
+            llm.llm_pending());
+        int n_prompt = 0, n_cached = 0;
+        user_state.conversation.prompt_tokens(n_prompt, n_cached);
+        ImGui::Text("Turns: %d, context: ~%d/%d", 
+            user_state.conversation.turns(), 
+            user_state.conversation.tokens(), 
+            user_state.conversation.budget());
+        ImGui::Text("Prompt cached: %d/%d", n_cached, n_prompt);
+        ImGui::SameLine();
+        if (ImGui::SmallButton("new chat")) user_state.conversation.clear();
+        int hits = 0, lookups = 0;
+        if (llm.cache_stats(hits, lookups)) {
+            ImGui::Text("Response cache: %d/%d", hits, lookups);
+        }
+        if (journal.enabled()) session();
+        int pages_done = 0, pages_total = 0;
+        if (document.progress(pages_done, pages_total)) {
+            std::string overlay = std::format("loading {}/{}", 
+                pages_done, pages_total);
+            ImGui::ProgressBar(pages_total > 0 ? 
+                float(pages_done) / pages_total : .0f, 
+                {-FLT_MIN, 0}, overlay.c_str());
+        }
         ImGui::Spacing();
 
         ImVec2 pos = ImGui::GetCursorScreenPos();
@@ -505,11 +789,30 @@ static auto llama = [](const ImVec2& pos,
                 bool is_selected = (model == user_state.model);
                 if (ImGui::Selectable(model.c_str(), is_selected)) {
                     user_state.model = model;
+                    server.warm(model);
                 }
                 if (is_selected) ImGui::SetItemDefaultFocus();
             }
             ImGui::EndCombo();
         }
+        if (server.managed()) {
+            ImGui::Text("Draft:");
+            ImGui::SetNextItemWidth(size.x);
+            std::string draft = server.draft(user_state.model);
+            if (ImGui::BeginCombo("##draft", 
+                draft.empty() ? "none" : draft.c_str())) {
+                if (ImGui::Selectable("none", draft.empty())) {
+                    server.pair(user_state.model, "");
+                }
+                for (auto const& model: user_state.models) {
+                    if (model == user_state.model) continue;
+                    if (ImGui::Selectable(model.c_str(), model == draft)) {
+                        server.pair(user_state.model, model);
+                    }
+                }
+                ImGui::EndCombo();
+            }
+        }
         ImGui::Text("Temperature:");
         ImGui::SetNextItemWidth(size.x);
         ImGui::DragFloat("##temperature", &user_state.temperature, 
@@ -526,6 +829,10 @@ static auto llama = [](const ImVec2& pos,
         ImGui::SetNextItemWidth(size.x);
         ImGui::DragFloat("##presence_penalty", &user_state.presence_penalty, 
             0.1f, -2.0f, 2.0f, "%.1f");
+        ImGui::Text("Seed:");
+        ImGui::SetNextItemWidth(size.x);
+        ImGui::DragInt("##seed", &user_state.seed, 
+            1, -1, INT_MAX, user_state.seed < 0 ? "random" : "%d");
 
         ImGui::Spacing();
         ImGui::Separator();
@@ -545,49 +852,6 @@ static auto llama = [](const ImVec2& pos,
     });
 };
 
-std::string load_txt_file(const std::string& path) {
-    std::ifstream f(path);
-    if (!f.is_open()) return "";
-    return std::string(std::istreambuf_iterator<char>(f), 
-        std::istreambuf_iterator<char>());
-}
-
-std::string load_pdf_file(const std::string& path) {
-    std::string content;
-    FPDF_DOCUMENT doc = FPDF_LoadDocument(path.c_str(), NULL);
-    if (doc) {
-        int n_pages = FPDF_GetPageCount(doc);
-        for (int i=0; i<n_pages; ++i) {
-            FPDF_PAGE page = FPDF_LoadPage(doc, i);
-            if (page == nullptr) continue;
-            FPDF_TEXTPAGE text_page = FPDFText_LoadPage(page);
-            if (text_page) {
-                int len = FPDFText_CountChars(text_page);
-                std::vector<unsigned short> u16_buffer(len + 1);
-                if (FPDFText_GetText(text_page, 0, 
-                        len, u16_buffer.data()) > 0) {
-                    std::string u8_buffer;
-                    utf8::utf16to8(u16_buffer.cbegin(), u16_buffer.cend(), 
-                        std::back_inserter(u8_buffer));
-                    content += u8_buffer;
-                }
-
-                FPDFText_ClosePage(text_page);
-            }
-
-            FPDF_ClosePage(page);
-        }
-
-        FPDF_CloseDocument(doc);
-    }
-    return content;
-}
-
-std::string load_file(const std::string& path) {
-    if (path.ends_with(".pdf")) return load_pdf_file(path);
-    return load_txt_file(path);
-}
-
 static auto choose_file = [](ImVec2 size) {
     ImGuiWindowFlags flags = ImGuiWindowFlags_NoResize;
     flags |= ImGuiWindowFlags_NoCollapse;
@@ -597,24 +861,24 @@ static auto choose_file = [](ImVec2 size) {
         if (ImGuiFileDialog::Instance()->IsOk()) {
             std::string path = ImGuiFileDialog::Instance()->GetFilePathName();
             //std::cout << path << std::endl;
-            std::string content = load_file(path);
-            //std::cout << "content: " << content << std::endl;
-            if (content.size() > 0) {
-                nlohmann::json request;
-                request["model"] = user_state.model;
-                request["temperature"] = user_state.temperature;
-                request["top_p"] = user_state.top_p;
-                request["top_k"] = user_state.top_k;
-                request["presence_penalty"] = user_state.presence_penalty;
-                request["messages"] = {
-                    {{"role", "system"}, 
-                        {"content", user_state.system_prompt}},
-                    {{"role", "user"}, 
-                        {"content", content}}
-                };
-                llm.generate(request);
+            nlohmann::json request;
+            request["model"] = user_state.model;
+            request["temperature"] = user_state.temperature;
+            request["top_p"] = user_state.top_p;
+            request["top_k"] = user_state.top_k;
+            request["presence_penalty"] = user_state.presence_penalty;
+            if (user_state.seed >= 0) request["seed"] = user_state.seed;
+            request["messages"] = {
+                {{"role", "system"}, 
+                    {"content", user_state.system_prompt}}
+            };
+            /* runs on the loader thread once the text is extracted */
+            document.load(path, [request](std::string content) {
+                //std::cout << "content: " << content << std::endl;
+                if (content.size() == 0) return;
 
                 int length = 512;
+                std::string shown = content;
                 if (content.size() > length) {
                     for (; length>0; --length) {
                         if ((content[length - 1] & 0x80) != 0x80) {
@@ -627,16 +891,41 @@ static auto choose_file = [](ImVec2 size) {
                             break;
                         }
                     }
-                    content = content.substr(0, length) + "...";
+                    shown = content.substr(0, length) + "...";
                 }
-                chat_message_t message{"user", content};
+                chat_message_t message{"user", shown};
                 user_state.chat_messages.push(message);
-            }
+                /* in place before a cached summary can finish */
+                int id = llm.reserve_id();
+                user_state.file_request_id = id;
+                document.summarize(request, content, {}, id);
+                ui_wakeup();
+            });
         }
         ImGuiFileDialog::Instance()->Close();
     }
 };
 
+/* size of the font atlas whenever it grew */
+static void report_atlas() {
+    static int width = 0, height = 0;
+    ImTextureData * tex = ImGui::GetIO().Fonts->TexData;
+    if (!tex || (tex->Width == width && tex->Height == height)) return;
+    width = tex->Width;
+    height = tex->Height;
+    std::cout << std::format("font atlas: {}x{}, {} KB\n", width, height, 
+        size_t(width) * height * tex->BytesPerPixel / 1024);
+}
+
+/* how long the main loop may sleep without events */
+static int idle_timeout() {
+    ImGuiIO& io = ImGui::GetIO();
+    if (ImGui::IsAnyItemActive() && !io.WantTextInput) return 0;
+    if (io.WantTextInput) return std::min(user_state.idle_ms, 100);
+    if (document.loading()) return std::min(user_state.idle_ms, 100);
+    return user_state.idle_ms;
+}
+
 void ui_update(SDL_Window * window) {
     int width = 0, height = 0;
     SDL_GetWindowSize(window, &width, &height);
@@ -686,26 +975,100 @@ void list_prompts(std::unordered_map<std::string, std::string>& m) {
 }
 
 static auto llm_generate_callback = 
-    [](const std::string& result) {
+    [](int id, const std::string& result, const llm_stats_t& stats) {
     chat_message_t message {"assistant", result};
-    user_state.chat_messages.push(message);
+    message._id = id;
+    message._ttft = stats.ttft;
+    message._tokens_per_second = stats.tokens_per_second;
+    message._n_prompt = stats.n_prompt;
+    message._n_cached = stats.n_cached;
+    message._n_drafted = stats.n_drafted;
+    message._n_accepted = stats.n_accepted;
+    message._from_cache = stats.from_cache;
+    user_state.chat_messages.finish(id, message);
+    ui_wakeup();
+
+    int request_id = id;
+    user_state.chat_request_id.compare_exchange_strong(request_id, 0);
+    request_id = id;
+    user_state.file_request_id.compare_exchange_strong(request_id, 0);
+};
+
+static auto llm_stream_callback = 
+    [](int id, const std::string& reason, const std::string& content) {
+    user_state.chat_messages.append(id, "assistant", reason, content);
+    ui_wakeup();
 };
 
 static auto llm_tool_callback = 
-    [](const nlohmann::json& func) {
+    [](std::shared_ptr<llm_tool_call_t> call) {
+    const nlohmann::json& func = call->call;
     std::cout << "llm_tool_callback: " << func.dump('\t') << std::endl;
     std::string result = "";
     try {
         std::string name = func["function"]["name"].get<std::string>();
         std::string arguments = func["function"]["arguments"].get<std::string>();
         nlohmann::json argv = nlohmann::json::parse(arguments);
-        result = llmtools.response(name, argv);
+        result = llmtools.response(name, argv, call);
     } catch (nlohmann::json::exception& e) {
         std::cout << "llm_tool_callback exception: " << e.what() << std::endl;
     }
     return result;
 };
 
+/* chat requests go to the server of their model */
+static void route_requests() {
+    if (!server.managed()) return;
+    llm.route({
+        [](const std::string& model, server_ready_callback on_ready) {
+            server.acquire(model, on_ready);
+        }, 
+        [](int instance, const llm_stats_t& stats) {
+            server_usage_t usage;
+            usage.n_tokens = stats.n_tokens;
+            if (stats.tokens_per_second > .0f) {
+                usage.seconds = stats.n_tokens / stats.tokens_per_second;
+            }
+            usage.n_drafted = stats.n_drafted;
+            usage.n_accepted = stats.n_accepted;
+            server.release(instance, usage);
+        }
+    });
+}
+
+/* no window, documents, journal or mcp servers. the requests are sent
+   once the server answers /health. */
+static int run_batch(const nlohmann::json& config, const std::string& input, 
+    const std::string& output, int concurrency) {
+    llm.init(config.value("llm", nlohmann::json::object()), 
+        nullptr, 
+        nullptr, 
+        llm_tool_callback, 
+        config.value("verbose", false));
+    route_requests();
+    nlohmann::json batch_config = config.value("batch", 
+        nlohmann::json::object());
+    batch.init(batch_config);
+    if (concurrency > 0) batch.set_concurrency(concurrency);
+
+    int failed = -1;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(
+        std::max(1, batch_config.value("ready_timeout", 300)));
+    while (!(server.accepting() && llm.llm_running()) && 
+        std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if (server.accepting() && llm.llm_running()) {
+        failed = batch.run(input, output);
+    } else {
+        std::cout << "llm server not ready." << std::endl;
+    }
+
+    server.shutdown();
+    llm.shutdown();
+    return failed == 0 ? 0 : -1;
+}
+
 int main(int argc, char *argv[]) {
     namespace po = boost::program_options;
     po::options_description desc("Allowed Options");
@@ -714,6 +1077,13 @@ int main(int argc, char *argv[]) {
         ("config,c", 
             po::value<std::string>()->default_value("config/config.json"),
             "set config file.")
+        ("batch,b", po::value<std::string>(), 
+            "run the chat requests of a jsonl file without the ui.")
+        ("output,o", 
+            po::value<std::string>()->default_value("responses.jsonl"), 
+            "set the jsonl file the batch responses are written to.")
+        ("concurrency,j", po::value<int>()->default_value(0), 
+            "set the batch requests in flight, 0 for the llm slots.")
         ;
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -732,12 +1102,22 @@ int main(int argc, char *argv[]) {
         f.close();
     }
 
-    if (server.init(config["server"])) {
+    if (server.init(config["server"], []() {
+        llm.recheck();
+        ui_wakeup();
+    })) {
         std::cout << "fail to start llama-server." << std::endl;
         return -1;
     }
+    if (vm.count("batch") > 0) {
+        return run_batch(config, vm["batch"].as<std::string>(), 
+            vm["output"].as<std::string>(), vm["concurrency"].as<int>());
+    }
 
     list_models(user_state.models);
+    if (server.managed() && server.default_model().size() > 0) {
+        user_state.model = server.default_model();
+    }
     list_prompts(user_state.prompts);
     
     FPDF_InitLibrary();
@@ -755,17 +1135,36 @@ int main(int argc, char *argv[]) {
     bool verbose = config.value("verbose", false);
     llm.init(config["llm"], 
         llm_generate_callback, 
+        llm_stream_callback, 
         llm_tool_callback, 
         verbose);
-    llmtools.init(config["mcp"]);
-    user_state.tool_names = llmtools.names();
-    user_state.tool_status = 
-        std::vector<unsigned char>(user_state.tool_names.size(), false);
+    route_requests();
+    document.init(config.value("document", nlohmann::json::object()), 
+        {llm_generate_callback, llm_stream_callback});
+    user_state.conversation.init(config.value("conversation", 
+        nlohmann::json::object()));
+    journal.init(config.value("journal", nlohmann::json::object()));
+    open_session(journal.session());
+    user_state.chat_messages.on_complete = [](const chat_message_t& message) {
+        journal.append(message);
+    };
+    llmtools.init(config["mcp"], []() { ui_wakeup(); });
 
+    /* frames are drawn for input, llm wakeups and a few frames after them
+       so ImGui settles, otherwise only every idle_ms */
+    const int settle_frames = 3;
+    int frames = settle_frames;
     bool done = false;
     while (!done) {
         SDL_Event ev;
-        while (SDL_PollEvent(&ev)) {
+        bool has_event = frames > 0 ? SDL_PollEvent(&ev) : 
+            SDL_WaitEventTimeout(&ev, idle_timeout());
+        for (; has_event; has_event = SDL_PollEvent(&ev)) {
+            frames = settle_frames;
+            if (ev.type == user_state.wakeup_event) {
+                user_state.wakeup_pending = false;
+                continue;
+            }
             ImGui_ImplSDL3_ProcessEvent(&ev);
             if (ev.type == SDL_EVENT_QUIT) done = true;
             if (ev.type == SDL_EVENT_WINDOW_CLOSE_REQUESTED && 
@@ -779,9 +1178,10 @@ int main(int argc, char *argv[]) {
         }
 
         if (SDL_GetWindowFlags(window) & SDL_WINDOW_MINIMIZED) {
-            SDL_Delay(100);
+            frames = 0;
             continue;
         }
+        if (frames > 0) --frames;
 
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplSDL3_NewFrame();
@@ -792,12 +1192,16 @@ int main(int argc, char *argv[]) {
         ImGui::Render();
         glClear(GL_COLOR_BUFFER_BIT);
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        if (verbose) report_atlas();
 
         SDL_GL_SwapWindow(window);
     }
 
     server.shutdown();
     llm.shutdown();
+    llmtools.shutdown();
+    document.shutdown();
+    journal.shutdown();
 
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplSDL3_Shutdown();
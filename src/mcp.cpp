@@ -0,0 +1,538 @@
+#include "mcp.h"
+#include "http.h"
+#include <chrono>
+#include <exception>
+#include <format>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/beast/http.hpp>
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+namespace http = boost::beast::http;
+namespace bp = boost::process;
+
+static const char * mcp_protocol_version = "2025-06-18";
+static const size_t max_idle = 4;
+
+static std::string json_string(const nlohmann::json& j, const char * key) {
+    if (j.contains(key) && j[key].is_string()) return j[key].get<std::string>();
+    return "";
+}
+
+static nlohmann::json rpc_error(const std::string& message) {
+    return {{"error", {{"code", -32000}, {"message", message}}}};
+}
+
+static std::string dump(const nlohmann::json& j) {
+    return j.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+/* the message answering id in a json body, or in the data of the events
+   of a text/event-stream body */
+static nlohmann::json find_response(const std::string& body, bool events, 
+    const nlohmann::json& id) {
+    std::vector<nlohmann::json> messages;
+    auto add = [&messages](const std::string& data) {
+        nlohmann::json j = nlohmann::json::parse(data, nullptr, false);
+        if (j.is_array()) {
+            for (auto& m: j) messages.push_back(std::move(m));
+        } else if (j.is_object()) {
+            messages.push_back(std::move(j));
+        }
+    };
+    if (!events) {
+        add(body);
+    } else {
+        std::string data = "";
+        size_t start = 0;
+        while (start <= body.size()) {
+            size_t eol = body.find('\n', start);
+            if (eol == std::string::npos) eol = body.size();
+            std::string line = body.substr(start, eol - start);
+            start = eol + 1;
+            if (line.size() > 0 && line.back() == '\r') line.pop_back();
+            if (line.empty()) {
+                if (data.size() > 0) add(data);
+                data.clear();
+            } else if (line.starts_with("data:")) {
+                line.erase(0, line.size() > 5 && line[5] == ' ' ? 6 : 5);
+                if (data.size() > 0) data.push_back('\n');
+                data += line;
+            }
+        }
+        if (data.size() > 0) add(data);
+    }
+    for (auto& m: messages) {
+        if (m.contains("id") && m["id"] == id && 
+            (m.contains("result") || m.contains("error"))) return m;
+    }
+    return rpc_error("no response in reply");
+}
+
+MCPClient::MCPClient(asio::io_context& ctx, const nlohmann::json& config) : 
+    ctx(ctx) {
+    server_name = json_string(config, "name");
+    timeout = std::chrono::seconds(config.value("timeout", 60));
+    connect_timeout = std::chrono::seconds(
+        config.value("connect_timeout", 10));
+    command = json_string(config, "command");
+    args = config.value("args", std::vector<std::string>{});
+    url = json_string(config, "url");
+    token = json_string(config, "token");
+    headers = config.value("headers", nlohmann::json::object());
+
+    if (url.size() > 0) {
+        http_url_t u;
+        if (http_parse_url(url, u)) {
+            scheme = u.scheme;
+            host = u.host;
+            port = u.port;
+        }
+        size_t path = url.find('/', url.find("://") + 3);
+        target = (path == std::string::npos) ? "/" : url.substr(path);
+        ssl_ctx.set_default_verify_paths();
+        ssl_ctx.set_verify_mode(asio::ssl::verify_peer);
+    }
+}
+
+/* the io thread is gone by now, a server still running is killed */
+MCPClient::~MCPClient() {
+    auto process = stop();
+    boost::system::error_code ec;
+    if (process && process->running(ec)) process->terminate(ec);
+    if (process) process->wait(ec);
+}
+
+asio::awaitable<int> MCPClient::connect() {
+    if (command.empty() && host.empty()) {
+        std::cerr << "mcp " << server_name << ": no command or url" << 
+            std::endl;
+        co_return -1;
+    }
+    if (command.size() > 0 && !alive && spawn() != 0) co_return -1;
+    if (co_await initialize() != 0) co_return -1;
+
+    std::vector<nlohmann::json> tools;
+    std::string cursor = "";
+    do {
+        nlohmann::json params = nlohmann::json::object();
+        if (cursor.size() > 0) params["cursor"] = cursor;
+        nlohmann::json response = co_await rpc("tools/list", params, 
+            connect_timeout);
+        if (!response.contains("result") || !response["result"].is_object()) {
+            std::cerr << "mcp " << server_name << ": tools/list: " << 
+                dump(response.value("error", nlohmann::json{})) << std::endl;
+            co_return -1;
+        }
+        auto& result = response["result"];
+        if (result.contains("tools") && result["tools"].is_array()) {
+            for (auto& tool: result["tools"]) tools.push_back(tool);
+        }
+        cursor = json_string(result, "nextCursor");
+    } while (cursor.size() > 0);
+    tool_list = std::move(tools);
+    co_return 0;
+}
+
+asio::awaitable<std::string> MCPClient::call(std::string tool, 
+    nlohmann::json arguments, std::shared_ptr<mcp_cancel_t> cancel) {
+    if (cancel && cancel->cancelled) co_return "error: cancelled";
+    /* a stdio server that exited is started again */
+    if (command.size() > 0 && !alive && co_await connect() != 0) {
+        co_return std::format("error: {} is not running", server_name);
+    }
+    nlohmann::json params = {{"name", tool}, {"arguments", arguments}};
+    nlohmann::json response = co_await rpc("tools/call", params, timeout, 
+        cancel);
+    if (!response.contains("result") || !response["result"].is_object()) {
+        nlohmann::json error = response.value("error", nlohmann::json{});
+        co_return "error: " + (error.is_object() ? 
+            json_string(error, "message") : dump(error));
+    }
+
+    auto& result = response["result"];
+    std::string text = "";
+    if (result.contains("content") && result["content"].is_array()) {
+        for (auto const& item: result["content"]) {
+            if (!item.is_object()) continue;
+            std::string type = json_string(item, "type");
+            if (text.size() > 0) text.push_back('\n');
+            if (type == "text") {
+                text += json_string(item, "text");
+            } else if (type == "resource" && item.contains("resource")) {
+                text += json_string(item["resource"], "text");
+            } else {
+                text += "[" + type + "]";
+            }
+        }
+    }
+    if (text.empty() && result.contains("structuredContent")) {
+        text = dump(result["structuredContent"]);
+    }
+    if (result.value("isError", false)) text = "error: " + text;
+    co_return text;
+}
+
+asio::awaitable<void> MCPClient::close() {
+    if (command.size() > 0) {
+        co_await reap(stop());
+        co_return;
+    }
+    /* let the server drop the session, it is not reused */
+    if (session_id.size() > 0 && idle.size() > 0) {
+        auto c = std::move(idle.back());
+        idle.pop_back();
+        http::request<http::string_body> req{http::verb::delete_, target, 11};
+        req.set(http::field::host, host);
+        req.set("Mcp-Session-Id", session_id);
+        if (token.size() > 0) {
+            req.set(http::field::authorization, "Bearer " + token);
+        }
+        req.prepare_payload();
+        http::response<http::string_body> res;
+        beast::error_code ec;
+        if (c->tls) {
+            beast::get_lowest_layer(*c->tls).expires_after(
+                std::chrono::seconds(1));
+            co_await http::async_write(*c->tls, req, 
+                asio::redirect_error(asio::use_awaitable, ec));
+            if (!ec) co_await http::async_read(*c->tls, c->buffer, res, 
+                asio::redirect_error(asio::use_awaitable, ec));
+        } else {
+            c->tcp->expires_after(std::chrono::seconds(1));
+            co_await http::async_write(*c->tcp, req, 
+                asio::redirect_error(asio::use_awaitable, ec));
+            if (!ec) co_await http::async_read(*c->tcp, c->buffer, res, 
+                asio::redirect_error(asio::use_awaitable, ec));
+        }
+    }
+    session_id.clear();
+    idle.clear();
+}
+
+asio::awaitable<int> MCPClient::initialize() {
+    if (command.empty()) session_id.clear();
+    nlohmann::json params = {
+        {"protocolVersion", mcp_protocol_version}, 
+        {"capabilities", nlohmann::json::object()}, 
+        {"clientInfo", {{"name", "chat.llm"}, {"version", "1.0"}}}
+    };
+    nlohmann::json response = co_await rpc("initialize", params, 
+        connect_timeout);
+    if (!response.contains("result") || !response["result"].is_object()) {
+        std::cerr << "mcp " << server_name << ": initialize: " << 
+            dump(response.value("error", nlohmann::json{})) << std::endl;
+        co_return -1;
+    }
+    protocol_version = json_string(response["result"], "protocolVersion");
+    co_await notify("notifications/initialized");
+    co_return 0;
+}
+
+asio::awaitable<nlohmann::json> MCPClient::rpc(std::string method, 
+    nlohmann::json params, std::chrono::seconds timeout, 
+    std::shared_ptr<mcp_cancel_t> cancel) {
+    if (cancel && cancel->cancelled) co_return rpc_error("cancelled");
+    int id = next_id++;
+    nlohmann::json message = {
+        {"jsonrpc", "2.0"}, 
+        {"id", id}, 
+        {"method", method}, 
+        {"params", params}
+    };
+
+    if (command.size() > 0) {
+        if (!alive) co_return rpc_error("server is not running");
+        auto w = std::make_shared<waiter_t>(ctx);
+        waiting[id] = w;
+        send(message);
+        w->signal.expires_after(timeout);
+        if (cancel) cancel->abort = [w]() {
+            w->aborted = true;
+            w->signal.cancel();
+        };
+        boost::system::error_code ec;
+        if (!w->done) co_await w->signal.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (cancel) cancel->abort = {};
+        waiting.erase(id);
+        if (w->done) co_return w->response;
+        /* the server may stop working on it, a late reply is dropped */
+        if (alive) send({
+            {"jsonrpc", "2.0"}, 
+            {"method", "notifications/cancelled"}, 
+            {"params", {{"requestId", id}, {"reason", w->aborted ? 
+                "cancelled" : "timed out"}}}
+        });
+        co_return rpc_error(method + (w->aborted ? " cancelled" : 
+            " timed out"));
+    }
+
+    nlohmann::json response;
+    int status = co_await post(message, response, timeout, cancel);
+    /* the server forgot the session, open a new one and ask again */
+    if (status == 404 && session_id.size() > 0 && method != "initialize" && 
+        !(cancel && cancel->cancelled)) {
+        if (co_await initialize() == 0) {
+            status = co_await post(message, response, timeout, cancel);
+        }
+    }
+    if (cancel && cancel->cancelled) co_return rpc_error(method + 
+        " cancelled");
+    if (status < 0) co_return rpc_error("connection failed");
+    if (status < 200 || status >= 300) {
+        co_return rpc_error(std::format("http status {}", status));
+    }
+    co_return response;
+}
+
+asio::awaitable<void> MCPClient::notify(std::string method) {
+    nlohmann::json message = {{"jsonrpc", "2.0"}, {"method", method}};
+    if (command.size() > 0) {
+        if (alive) send(message);
+        co_return;
+    }
+    nlohmann::json response;
+    co_await post(message, response, connect_timeout);
+}
+
+int MCPClient::spawn() {
+    asio::co_spawn(ctx, reap(stop()), asio::detached);
+    try {
+        std::string exe = command;
+        if (command.find('/') == std::string::npos) {
+            exe = bp::environment::find_executable(command).string();
+            if (exe.empty()) {
+                std::cerr << "mcp " << server_name << ": " << command << 
+                    " not found" << std::endl;
+                return -1;
+            }
+        }
+        stdin_pipe = std::make_unique<asio::writable_pipe>(ctx);
+        stdout_pipe = std::make_unique<asio::readable_pipe>(ctx);
+        /* stderr is the server's log, it goes to ours */
+        proc = std::make_unique<bp::process>(ctx.get_executor(), exe, args, 
+            bp::process_stdio{*stdin_pipe, *stdout_pipe, {}});
+    } catch (std::exception const& e) {
+        std::cerr << "mcp " << server_name << ": " << e.what() << std::endl;
+        asio::co_spawn(ctx, reap(stop()), asio::detached);
+        return -1;
+    }
+    alive = true;
+    asio::co_spawn(ctx, reader(++generation), asio::detached);
+    return 0;
+}
+
+/* messages are single lines, written in order by one writer */
+void MCPClient::send(const nlohmann::json& message) {
+    outbox.push_back(dump(message) + "\n");
+    if (writing) return;
+    writing = true;
+    asio::co_spawn(ctx, writer(), asio::detached);
+}
+
+asio::awaitable<void> MCPClient::writer() {
+    while (outbox.size() > 0 && alive) {
+        std::string line = std::move(outbox.front());
+        outbox.pop_front();
+        boost::system::error_code ec;
+        co_await asio::async_write(*stdin_pipe, asio::buffer(line), 
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) break;
+    }
+    outbox.clear();
+    writing = false;
+}
+
+/* gen tells a reader of a stopped process to leave the new one alone */
+asio::awaitable<void> MCPClient::reader(int gen) {
+    std::string pending;
+    while (alive && gen == generation) {
+        boost::system::error_code ec;
+        size_t n = co_await asio::async_read_until(*stdout_pipe, 
+            asio::dynamic_buffer(pending), '\n', 
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) break;
+        nlohmann::json message = nlohmann::json::parse(
+            pending.begin(), pending.begin() + n, nullptr, false);
+        pending.erase(0, n);
+        if (message.is_object()) receive(message);
+    }
+    if (gen != generation) co_return;
+    if (alive) {
+        std::cerr << "mcp " << server_name << ": server exited" << std::endl;
+    }
+    alive = false;
+    for (auto& [id, w]: waiting) {
+        w->response = rpc_error("server exited");
+        w->done = true;
+        w->signal.cancel();
+    }
+}
+
+void MCPClient::receive(const nlohmann::json& message) {
+    if (!message.contains("id")) return;
+    /* a request of the server, only ping is answered */
+    if (message.contains("method")) {
+        nlohmann::json reply = {{"jsonrpc", "2.0"}, {"id", message["id"]}};
+        if (json_string(message, "method") == "ping") {
+            reply["result"] = nlohmann::json::object();
+        } else {
+            reply["error"] = {
+                {"code", -32601}, {"message", "method not found"}
+            };
+        }
+        send(reply);
+        return;
+    }
+    if (!message["id"].is_number_integer()) return;
+    auto it = waiting.find(message["id"].get<int>());
+    if (it == waiting.end()) return;
+    it->second->response = message;
+    it->second->done = true;
+    it->second->signal.cancel();
+}
+
+/* closing stdin asks the server to exit */
+std::unique_ptr<bp::process> MCPClient::stop() {
+    alive = false;
+    boost::system::error_code ec;
+    if (stdin_pipe) stdin_pipe->close(ec);
+    if (stdout_pipe) stdout_pipe->close(ec);
+    return std::move(proc);
+}
+
+/* a server that lingers is asked again after 200 ms and killed after a
+   second, the io thread keeps running meanwhile */
+asio::awaitable<void> MCPClient::reap(std::unique_ptr<bp::process> process) {
+    if (!process) co_return;
+    asio::steady_timer timer(ctx);
+    boost::system::error_code ec;
+    for (int i=0; i<50 && process->running(ec); ++i) {
+        if (i == 10) process->request_exit(ec);
+        timer.expires_after(std::chrono::milliseconds(20));
+        co_await timer.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+    }
+    if (process->running(ec)) process->terminate(ec);
+    process->wait(ec);
+}
+
+asio::awaitable<std::unique_ptr<mcp_connection_t>> MCPClient::open_connection(
+    std::chrono::seconds timeout) {
+    auto c = std::make_unique<mcp_connection_t>();
+    asio::ip::tcp::resolver resolver(ctx);
+    auto endpoints = co_await resolver.async_resolve(host, port, 
+        asio::use_awaitable);
+    if (scheme == "https") {
+        c->tls = std::make_unique<beast::ssl_stream<beast::tcp_stream>>(ctx, 
+            ssl_ctx);
+        if (!SSL_set_tlsext_host_name(c->tls->native_handle(), host.c_str())) {
+            throw beast::system_error{beast::error_code(
+                static_cast<int>(::ERR_get_error()), 
+                asio::error::get_ssl_category())};
+        }
+        c->tls->set_verify_callback(asio::ssl::host_name_verification(host));
+        beast::get_lowest_layer(*c->tls).expires_after(timeout);
+        co_await beast::get_lowest_layer(*c->tls).async_connect(endpoints, 
+            asio::use_awaitable);
+        co_await c->tls->async_handshake(asio::ssl::stream_base::client, 
+            asio::use_awaitable);
+    } else {
+        c->tcp = std::make_unique<beast::tcp_stream>(ctx);
+        c->tcp->expires_after(timeout);
+        co_await c->tcp->async_connect(endpoints, asio::use_awaitable);
+    }
+    co_return c;
+}
+
+asio::awaitable<int> MCPClient::post(nlohmann::json message, 
+    nlohmann::json& response, std::chrono::seconds timeout, 
+    std::shared_ptr<mcp_cancel_t> cancel) {
+    if (scheme != "http" && scheme != "https") {
+        std::cerr << "mcp " << server_name << ": unsupported url " << url << 
+            std::endl;
+        co_return -1;
+    }
+    http::request<http::string_body> req{http::verb::post, target, 11};
+    req.set(http::field::host, host);
+    req.set(http::field::content_type, "application/json");
+    req.set(http::field::accept, "application/json, text/event-stream");
+    if (token.size() > 0) {
+        req.set(http::field::authorization, "Bearer " + token);
+    }
+    for (auto const& [key, value]: headers.items()) {
+        if (value.is_string()) req.set(key, value.get<std::string>());
+    }
+    if (session_id.size() > 0) req.set("Mcp-Session-Id", session_id);
+    if (protocol_version.size() > 0) {
+        req.set("MCP-Protocol-Version", protocol_version);
+    }
+    req.keep_alive(true);
+    req.body() = dump(message);
+    req.prepare_payload();
+
+    /* an idle connection may have been closed by the server meanwhile, 
+       that costs one retry on a new one */
+    for (int attempt=0; attempt<2; ++attempt) {
+        if (cancel && cancel->cancelled) co_return -1;
+        std::unique_ptr<mcp_connection_t> c;
+        bool reused = idle.size() > 0;
+        if (reused) {
+            c = std::move(idle.back());
+            idle.pop_back();
+        }
+        http::response_parser<http::string_body> parser;
+        parser.body_limit(boost::none);
+        try {
+            if (!c) c = co_await open_connection(timeout);
+            if (cancel && cancel->cancelled) co_return -1;
+            /* closing the socket ends the call, the connection is lost */
+            if (cancel) cancel->abort = [c = c.get()]() {
+                beast::error_code ec;
+                if (c->tls) beast::get_lowest_layer(*c->tls).socket().close(ec);
+                else c->tcp->socket().close(ec);
+            };
+            if (c->tls) {
+                beast::get_lowest_layer(*c->tls).expires_after(timeout);
+                co_await http::async_write(*c->tls, req, asio::use_awaitable);
+                co_await http::async_read(*c->tls, c->buffer, parser, 
+                    asio::use_awaitable);
+            } else {
+                c->tcp->expires_after(timeout);
+                co_await http::async_write(*c->tcp, req, asio::use_awaitable);
+                co_await http::async_read(*c->tcp, c->buffer, parser, 
+                    asio::use_awaitable);
+            }
+        } catch (std::exception const& e) {
+            if (cancel) cancel->abort = {};
+            if (cancel && cancel->cancelled) co_return -1;
+            if (reused) {
+                idle.clear();
+                continue;
+            }
+            std::cerr << "mcp " << server_name << ": " << e.what() << 
+                std::endl;
+            co_return -1;
+        }
+
+        if (cancel) cancel->abort = {};
+        auto& res = parser.get();
+        if (res.count("Mcp-Session-Id") > 0) {
+            session_id = std::string(res["Mcp-Session-Id"]);
+        }
+        if (res.keep_alive() && idle.size() < max_idle) {
+            idle.push_back(std::move(c));
+        }
+        int status = res.result_int();
+        if (message.contains("id") && status != 202) {
+            std::string type = std::string(res[http::field::content_type]);
+            response = find_response(res.body(), 
+                type.starts_with("text/event-stream"), message["id"]);
+        }
+        co_return status;
+    }
+    co_return -1;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/ssl.hpp>
+#include <boost/process.hpp>
+
+/* one kept-alive connection to a streamable http server */
+typedef struct _mcp_connection_t {
+    std::unique_ptr<boost::beast::tcp_stream> tcp;
+    std::unique_ptr<boost::beast::ssl_stream<boost::beast::tcp_stream>> tls;
+    boost::beast::flat_buffer buffer;
+} mcp_connection_t;
+
+/* the way to give up on a call. set on the io thread of the client: abort
+   is what stops the current wait, cancelled keeps the call from going on */
+typedef struct _mcp_cancel_t {
+    bool cancelled = false;
+    std::function<void ()> abort;
+} mcp_cancel_t;
+
+/* client of one model context protocol server, started over stdio:
+
+     {"name": "files", "command": "npx", "args": ["..."]}
+
+   or reached over streamable http:
+
+     {"name": "deepwiki", "url": "https://...", "token": "", "headers": {}}
+
+   the session is opened once and kept. a stdio server runs until close and
+   its replies are matched to requests by json-rpc id, so calls overlap. an
+   http server keeps its Mcp-Session-Id, finished connections stay open for
+   the next call. everything runs on the io_context given to the
+   constructor, which must be run by a single thread. */
+class MCPClient {
+public:
+    MCPClient(boost::asio::io_context& ctx, const nlohmann::json& config);
+    ~MCPClient();
+
+    MCPClient(const MCPClient&) = delete;
+    MCPClient& operator=(const MCPClient&) = delete;
+
+    const std::string& name() const { return server_name; };
+    /* schemas from the last tools/list */
+    const std::vector<nlohmann::json>& tools() const { return tool_list; };
+
+    /* open the session and list its tools, 0 on success */
+    boost::asio::awaitable<int> connect();
+    /* tools/call, the text of the result or "error: ..." */
+    boost::asio::awaitable<std::string> call(std::string tool, 
+        nlohmann::json arguments, std::shared_ptr<mcp_cancel_t> cancel = {});
+    boost::asio::awaitable<void> close();
+
+private:
+    typedef struct _waiter_t {
+        boost::asio::steady_timer signal;
+        nlohmann::json response;
+        bool done = false;
+        bool aborted = false;
+        _waiter_t(boost::asio::io_context& ctx) : signal(ctx) {}
+    } waiter_t;
+
+    boost::asio::awaitable<int> initialize();
+    /* the response message, transport errors are turned into an error */
+    boost::asio::awaitable<nlohmann::json> rpc(std::string method, 
+        nlohmann::json params, std::chrono::seconds timeout, 
+        std::shared_ptr<mcp_cancel_t> cancel = {});
+    boost::asio::awaitable<void> notify(std::string method);
+
+    /* stdio */
+    int spawn();
+    void send(const nlohmann::json& message);
+    boost::asio::awaitable<void> writer();
+    boost::asio::awaitable<void> reader(int gen);
+    void receive(const nlohmann::json& message);
+    /* the process to reap, if there is one */
+    std::unique_ptr<boost::process::process> stop();
+    boost::asio::awaitable<void> reap(
+        std::unique_ptr<boost::process::process> process);
+
+    /* streamable http, returns the http status or -1 */
+    boost::asio::awaitable<int> post(nlohmann::json message, 
+        nlohmann::json& response, std::chrono::seconds timeout, 
+        std::shared_ptr<mcp_cancel_t> cancel = {});
+    boost::asio::awaitable<std::unique_ptr<mcp_connection_t>> open_connection(
+        std::chrono::seconds timeout);
+
+    boost::asio::io_context& ctx;
+    std::string server_name;
+    std::chrono::seconds timeout{60};
+    std::chrono::seconds connect_timeout{10};
+    std::vector<nlohmann::json> tool_list;
+    std::string protocol_version = "";
+    int next_id = 1;
+
+    std::string command = "";
+    std::vector<std::string> args;
+    std::unique_ptr<boost::process::process> proc;
+    std::unique_ptr<boost::asio::writable_pipe> stdin_pipe;
+    std::unique_ptr<boost::asio::readable_pipe> stdout_pipe;
+    bool alive = false;
+    int generation = 0;
+    std::deque<std::string> outbox;
+    bool writing = false;
+    std::unordered_map<int, std::shared_ptr<waiter_t>> waiting;
+
+    std::string url = "";
+    std::string scheme = "http";
+    std::string host = "";
+    std::string port = "";
+    std::string target = "/";
+    std::string token = "";
+    nlohmann::json headers;
+    std::string session_id = "";
+    boost::asio::ssl::context ssl_ctx{boost::asio::ssl::context::tls_client};
+    std::vector<std::unique_ptr<mcp_connection_t>> idle;
+};
@@ -1,6 +1,14 @@
 #pragma once
 
+#include "think.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <mutex>
 #include <iomanip>
@@ -11,6 +19,16 @@ typedef struct _chat_message_t {
     std::string _role;
     std::string _reason;
     std::string _content;
+    int _id = 0;                    //llm request id
+    bool _streaming = false;
+    float _ttft = .0f;
+    float _tokens_per_second = .0f;
+    int _n_prompt = 0;
+    int _n_cached = 0;              //prompt tokens reused from the kv cache
+    int _n_drafted = 0;             //speculative tokens from the draft model
+    int _n_accepted = 0;
+    bool _from_cache = false;       //replayed from the response cache
+    bool _paged = false;            //not read from the journal yet
 
     _chat_message_t(const std::string& role, const std::string& content) {
         std::time_t t = std::time(nullptr);
@@ -19,40 +37,292 @@ typedef struct _chat_message_t {
         _time = oss.str();
         _role = role;
 
-        std::string think_prefix = "<think>";
-        std::string think_postfix = "</think>\n\n";
-
-        size_t think_prefix_pos = content.find(think_prefix);
-        size_t think_postfix_pos = content.find(think_postfix);
-        if (think_prefix_pos == std::string::npos || 
-            think_postfix_pos == std::string::npos || 
-            think_prefix_pos > think_postfix_pos) {
-            _reason = "";
+        if (role == "user") {
             _content = content;
-        } else {
-            _reason = content.substr(think_prefix_pos + think_prefix.size(), 
-                think_postfix_pos - think_prefix_pos - think_prefix.size());
-            _content = content.substr(think_postfix_pos + think_postfix.size());
+            return;
         }
+        think_parser_t parser;
+        auto emit = [this](bool reasoning, std::string_view span) {
+            (reasoning ? _reason : _content).append(span);
+        };
+        parser.feed(content, emit);
+        parser.finish(emit);
     }
 } chat_message_t;
 
+/* messages are kept in fixed-size segments shared between the store and
+   the views it publishes */
+inline constexpr int chat_segment_size = 64;
+typedef std::array<std::shared_ptr<chat_message_t>, chat_segment_size> 
+    chat_segment_t;
+
+/* immutable view of the messages. i counts from the oldest message still
+   kept, seq(i) stays the same for a message as long as the store lives. */
+typedef struct _chat_history_t {
+    std::vector<std::shared_ptr<const chat_segment_t>> segments;
+    uint64_t first = 0;             //seq of the oldest message
+    uint64_t end = 0;               //seq after the newest message
+
+    size_t size() const { return end - first; };
+    bool empty() const { return end == first; };
+    uint64_t seq(size_t i) const { return first + i; };
+    /* how many leading messages are the same objects in both views, whole
+       segments that are still shared are skipped */
+    size_t shared_prefix(const _chat_history_t& other) const {
+        if (other.first != first) return 0;
+        uint64_t seq = first;
+        uint64_t stop = first + std::min(size(), other.size());
+        while (seq < stop) {
+            size_t k = seq / chat_segment_size - first / chat_segment_size;
+            if (segments[k] == other.segments[k]) {
+                seq = std::min(stop, 
+                    (seq / chat_segment_size + 1) * chat_segment_size);
+            } else if ((*segments[k])[seq % chat_segment_size] == 
+                (*other.segments[k])[seq % chat_segment_size]) {
+                ++seq;
+            } else {
+                break;
+            }
+        }
+        return seq - first;
+    }
+
+    const chat_message_t& operator[](size_t i) const {
+        uint64_t seq = first + i;
+        return *(*segments[seq / chat_segment_size - 
+            first / chat_segment_size])[seq % chat_segment_size];
+    }
+} chat_history_t;
+typedef std::shared_ptr<const chat_history_t> chat_snapshot_t;
+
+/* message i of those given to load, false if it can't be read */
+typedef std::function<bool (size_t, chat_message_t&)> chat_message_reader;
+
+/* ring of at most max_size messages. every change publishes a new view;
+   segments and messages still held by a reader's view are copied before
+   they are written, so a view never changes once a reader has it. a view
+   nobody took is written in place, so a streamed message is only copied
+   when a frame is holding it. readers wait for the pointer swap and for
+   an in-place delta, never for on_complete. */
 typedef struct _chat_messages_t {
-    std::mutex mtx;
     int max_size = 10000;
-    std::vector<chat_message_t> messages;
+    /* a message was pushed or finished streaming, called in order without
+       mtx held */
+    std::function<void (const chat_message_t&)> on_complete;
+
+    void push(chat_message_t message) {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            std::lock_guard<std::mutex> vlk(view_mtx);
+            retract();
+            completed.push_back(get(add(std::move(message))));
+            publish();
+        }
+        complete();
+    }
 
-    void push(const chat_message_t& message) {
+    /* replace all messages with n that are read on demand, without
+       on_complete. until page reads it, message i is a shared placeholder.
+       seq numbers go on from the previous ones. */
+    void load(size_t n, chat_message_reader reader) {
         std::lock_guard<std::mutex> lk(mtx);
-        if (messages.size() > max_size) 
-            messages.erase(messages.begin());
-        messages.push_back(message);
+        std::lock_guard<std::mutex> vlk(view_mtx);
+        segments.clear();
+        streaming.clear();
+        end = (end + chat_segment_size - 1) / chat_segment_size * 
+            chat_segment_size;
+        first = end;
+        paged_first = end;
+        pager = std::move(reader);
+        ++pager_generation;
+        auto placeholder = std::make_shared<chat_message_t>("", "");
+        placeholder->_paged = true;
+        for (size_t i=0; i<n; ++i) {
+            if (end % chat_segment_size == 0) 
+                segments.push_back(std::make_shared<chat_segment_t>());
+            uint64_t seq = end++;
+            (*segments.back())[seq % chat_segment_size] = placeholder;
+        }
+        while (end - first > std::max(max_size, 1)) {
+            if (++first % chat_segment_size == 0) segments.pop_front();
+        }
+        publish();
+    }
+
+    /* read the placeholders in [begin, end) of seq, true if any was */
+    bool page(uint64_t begin, uint64_t end) {
+        std::vector<std::pair<uint64_t, chat_message_t>> read;
+        chat_message_reader reader;
+        int generation = 0;
+        uint64_t offset = 0;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            begin = std::max(begin, first);
+            end = std::min(end, this->end);
+            for (uint64_t seq=begin; seq<end; ++seq) {
+                if (get(seq)->_paged) read.push_back({seq, {"", ""}});
+            }
+            if (read.empty()) return false;
+            reader = pager;
+            generation = pager_generation;
+            offset = paged_first;
+        }
+        /* decoded without the locks, a load meanwhile discards them */
+        for (auto& [seq, message]: read) {
+            if (!reader || !reader(seq - offset, message)) {
+                message._content = "(unreadable)";
+            }
+        }
+        std::lock_guard<std::mutex> lk(mtx);
+        if (generation != pager_generation) return false;
+        std::lock_guard<std::mutex> vlk(view_mtx);
+        retract();
+        for (auto& [seq, message]: read) {
+            if (seq < first || !get(seq)->_paged) continue;
+            writable_segment(seq)[seq % chat_segment_size] = 
+                std::make_shared<chat_message_t>(std::move(message));
+        }
+        publish();
+        return true;
     }
 
-    std::vector<chat_message_t> snapshot() {
+    /* append streamed deltas to the in-flight message of request id */
+    void append(int id, const std::string& role, const std::string& reason, 
+        const std::string& content) {
         std::lock_guard<std::mutex> lk(mtx);
-        return messages;
+        std::lock_guard<std::mutex> vlk(view_mtx);
+        retract();
+        uint64_t seq = in_flight(id);
+        if (seq == end) {
+            chat_message_t message{role, ""};
+            message._id = id;
+            message._streaming = true;
+            seq = add(std::move(message));
+            streaming[id] = seq;
+        }
+        chat_message_t& message = writable(seq);
+        message._reason += reason;
+        message._content += content;
+        publish();
+    }
+
+    /* replace the in-flight message of request id with the completed one */
+    void finish(int id, chat_message_t message) {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            bool empty = message._reason.empty() && message._content.empty();
+            uint64_t seq = in_flight(id);
+            if (seq == end && empty) return;
+            std::lock_guard<std::mutex> vlk(view_mtx);
+            retract();
+            streaming.erase(id);
+            if (seq != end) {
+                if (empty) writable(seq)._streaming = false;
+                else writable(seq) = std::move(message);
+            } else {
+                seq = add(std::move(message));
+            }
+            completed.push_back(get(seq));
+            publish();
+        }
+        complete();
     }
+
+    chat_snapshot_t snapshot() {
+        std::lock_guard<std::mutex> lk(view_mtx);
+        return view;
+    }
+
+private:
+    /* called with neither lock held. one thread at a time reports the
+       completed messages in order, mtx is only taken to pick the next. */
+    void complete() {
+        std::lock_guard<std::mutex> clk(complete_mtx);
+        while (true) {
+            std::shared_ptr<const chat_message_t> message;
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                if (completed.empty()) return;
+                message = std::move(completed.front());
+                completed.pop_front();
+            }
+            if (on_complete) on_complete(*message);
+        }
+    }
+
+    /* everything below is called with mtx and view_mtx held */
+    uint64_t add(chat_message_t&& message) {
+        if (end % chat_segment_size == 0) 
+            segments.push_back(std::make_shared<chat_segment_t>());
+        uint64_t seq = end++;
+        writable_segment(seq)[seq % chat_segment_size] = 
+            std::make_shared<chat_message_t>(std::move(message));
+        while (end - first > std::max(max_size, 1)) {
+            if (++first % chat_segment_size == 0) segments.pop_front();
+        }
+        return seq;
+    }
+
+    std::shared_ptr<const chat_message_t> get(uint64_t seq) const {
+        return (*segments[seq / chat_segment_size - 
+            first / chat_segment_size])[seq % chat_segment_size];
+    }
+
+    /* the published view no reader took doesn't need to stay intact */
+    void retract() {
+        if (view.use_count() == 1) view.reset();
+    }
+
+    chat_segment_t& writable_segment(uint64_t seq) {
+        auto& segment = segments[seq / chat_segment_size - 
+            first / chat_segment_size];
+        if (segment.use_count() > 1) 
+            segment = std::make_shared<chat_segment_t>(*segment);
+        return *segment;
+    }
+
+    chat_message_t& writable(uint64_t seq) {
+        auto& message = writable_segment(seq)[seq % chat_segment_size];
+        if (message.use_count() > 1) 
+            message = std::make_shared<chat_message_t>(*message);
+        return *message;
+    }
+
+    /* seq of the in-flight message of request id, end if there is none
+       or it was dropped from the front meanwhile */
+    uint64_t in_flight(int id) {
+        auto it = streaming.find(id);
+        if (it == streaming.end()) return end;
+        if (it->second < first) {
+            streaming.erase(it);
+            return end;
+        }
+        return it->second;
+    }
+
+    void publish() {
+        auto history = std::make_shared<chat_history_t>();
+        history->segments.assign(segments.begin(), segments.end());
+        history->first = first;
+        history->end = end;
+        view = std::move(history);
+    }
+
+    std::mutex mtx;
+    std::deque<std::shared_ptr<chat_segment_t>> segments;
+    /* request id to the seq of its in-flight message */
+    std::unordered_map<int, uint64_t> streaming;
+    uint64_t first = 0;
+    uint64_t end = 0;
+
+    uint64_t paged_first = 0;       //seq of the reader's message 0
+    chat_message_reader pager;
+    int pager_generation = 0;
+
+    std::deque<std::shared_ptr<const chat_message_t>> completed;
+    std::mutex complete_mtx;
+    std::mutex view_mtx;
+    chat_snapshot_t view = std::make_shared<const chat_history_t>();
 } chat_messages_t;
 
 /* test data */
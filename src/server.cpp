@@ -1,33 +1,601 @@
 #include "server.h"
+#include "http.h"
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <iostream>
 #include <memory>
+#include <regex>
 #include <vector>
 #include <boost/process.hpp>
 
-int Server::init(const nlohmann::json& config) {
-    std::string bin = config.value("bin", 
+namespace asio = boost::asio;
+namespace bp = boost::process;
+namespace fs = std::filesystem;
+
+/* "Qwen3" of "Qwen3-0.6B-Q8_0", "" without a size in the name */
+static std::string model_family(const std::string& name) {
+    static const std::regex size(R"(^(.+?)-[0-9]+(\.[0-9]+)?[BbMm](-|$))");
+    std::smatch m;
+    if (!std::regex_search(name, m, size)) return "";
+    return m[1].str();
+}
+
+int Server::init(const nlohmann::json& config, 
+    std::function<void ()> on_change /* = {} */) {
+    bin = config.value("bin", 
         "tools/llama-server");
-    std::vector<std::string> args = 
+    std::vector<std::string> all = 
         config.value<std::vector<std::string>>("args", 
             {
             "--model", "models/Qwen3-0.6B-Q8_0.gguf", 
             "--ctx-size", "2048"
             });
-
-    bool on = config.value("on", false);
-    if (on) {
-        proc.reset(new boost::process::process(
-            ctx.get_executor(), 
-            bin, 
-            args));
+    /* --model, --model-draft, --host and --port are given per instance */
+    args.clear();
+    std::string draft_path = "";
+    for (size_t i=0; i<all.size(); ++i) {
+        bool has_value = i + 1 < all.size();
+        if ((all[i] == "--model" || all[i] == "-m") && has_value) {
+            model_path = all[++i];
+        } else if ((all[i] == "--model-draft" || all[i] == "-md") && 
+            has_value) {
+            draft_path = all[++i];
+        } else if (all[i] == "--host" && has_value) {
+            host = all[++i];
+        } else if (all[i] == "--port" && has_value) {
+            base_port = std::atoi(all[++i].c_str());
+        } else {
+            args.push_back(all[i]);
+        }
+    }
+    models_dir = config.value("models_dir", "models");
+    model = config.value("model", model_path.size() > 0 ? 
+        fs::path(model_path).stem().string() : "");
+    memory_budget = uint64_t(std::max(0, config.value("memory_mb", 0))) << 20;
+    overhead = uint64_t(std::max(0, config.value("overhead_mb", 512))) << 20;
+    idle_timeout = std::chrono::seconds(
+        std::max(0, config.value("idle_seconds", 600)));
+    log_lines = std::max(1, config.value("log_lines", 500));
+    max_restarts = std::max(0, config.value("max_restarts", 5));
+    stable_uptime = std::chrono::seconds(
+        std::max(0, config.value("stable_seconds", 60)));
+    nlohmann::json draft = config.value("draft", nlohmann::json::object());
+    draft_args = draft.value<std::vector<std::string>>("args", 
+        {"--draft-max", "16", "--draft-min", "1", "--draft-p-min", "0.75"});
+    auto_draft = draft.value("auto", false);
+    drafts.clear();
+    nlohmann::json pairs = draft.value("pairs", nlohmann::json::object());
+    for (auto const& [target, name]: pairs.items()) {
+        if (name.is_string()) drafts[target] = name.get<std::string>();
+    }
+    if (draft_path.size() > 0 && model.size() > 0) {
+        drafts[model] = fs::path(draft_path).stem().string();
     }
+    this->on_change = on_change;
 
+    on = config.value("on", false);
+    if (!on) return 0;
+    if (model.empty() || !start(model)) return -1;
+    for (auto const& name: config.value("prewarm", 
+        std::vector<std::string>{})) {
+        if (name != model) start(name);
+    }
+    asio::co_spawn(ctx, reaper(), asio::detached);
+    supervisor_thread = std::thread([this]() { ctx.run(); });
     return 0;
 }
 
 int Server::shutdown() {
-    if (proc->running()) {
-        proc->interrupt();
-        proc->wait();
+    if (!supervisor_thread.joinable()) return 0;
+    asio::co_spawn(ctx, stop(), asio::detached);
+    supervisor_thread.join();
+    std::lock_guard<std::mutex> lk(mtx);
+    pool.clear();
+    return 0;
+}
+
+bool Server::accepting() {
+    if (!on) return true;
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = pool.find(model);
+    return it != pool.end() && it->second->info.status == server_ready;
+}
+
+void Server::acquire(const std::string& model, 
+    server_ready_callback on_ready) {
+    asio::post(ctx, [this, model, on_ready]() {
+        auto inst = stopping ? nullptr : get(model);
+        if (!inst) {
+            on_ready("", 0);
+            return;
+        }
+        if (inst->info.status != server_ready) {
+            inst->waiters.push_back(on_ready);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            ++inst->info.busy;
+        }
+        on_ready(url(*inst), inst->id);
+    });
+}
+
+/* an instance that was evicted since is gone, along with its count */
+void Server::release(int instance, const server_usage_t& usage /* = {} */) {
+    asio::post(ctx, [this, instance, usage]() {
+        std::shared_ptr<instance_t> inst;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            auto it = std::find_if(pool.begin(), pool.end(), 
+                [instance](auto const& p) {
+                    return p.second->id == instance;
+                });
+            if (it == pool.end()) return;
+            inst = it->second;
+            if (inst->info.busy > 0) --inst->info.busy;
+            inst->last_used = std::chrono::steady_clock::now();
+            if (usage.n_tokens > 0) {
+                auto& p = paired[{inst->info.model, inst->info.draft}];
+                p.model = inst->info.model;
+                p.draft = inst->info.draft;
+                ++p.requests;
+                p.usage.n_tokens += usage.n_tokens;
+                p.usage.seconds += usage.seconds;
+                p.usage.n_drafted += usage.n_drafted;
+                p.usage.n_accepted += usage.n_accepted;
+            }
+            if (!inst->stale || inst->info.busy > 0) return;
+        }
+        restart(inst);
+    });
+}
+
+void Server::warm(const std::string& model) {
+    if (!on) return;
+    asio::post(ctx, [this, model]() {
+        if (!stopping) get(model);
+    });
+}
+
+std::string Server::draft(const std::string& model) {
+    std::string name = model.empty() ? this->model : model;
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = pool.find(name);
+    if (it != pool.end()) return it->second->info.draft;
+    auto d = drafts.find(name);
+    return d == drafts.end() ? "" : d->second;
+}
+
+void Server::pair(const std::string& model, const std::string& draft) {
+    if (!on) return;
+    asio::post(ctx, [this, model, draft]() {
+        std::string name = model.empty() ? this->model : model;
+        std::shared_ptr<instance_t> inst;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            drafts[name] = draft;
+            auto it = pool.find(name);
+            if (it == pool.end() || it->second->info.draft == draft) return;
+            inst = it->second;
+            if (inst->info.busy > 0) {
+                inst->stale = true;
+                return;
+            }
+        }
+        restart(inst);
+    });
+}
+
+std::vector<server_info_t> Server::instances() {
+    std::vector<server_info_t> infos;
+    std::lock_guard<std::mutex> lk(mtx);
+    for (auto const& [name, inst]: pool) infos.push_back(inst->info);
+    std::sort(infos.begin(), infos.end(), [](auto const& a, auto const& b) {
+        return a.port < b.port;
+    });
+    return infos;
+}
+
+std::vector<std::string> Server::log(const std::string& model) {
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = pool.find(model);
+    if (it == pool.end()) return {};
+    return {it->second->lines.begin(), it->second->lines.end()};
+}
+
+std::vector<server_pairing_t> Server::pairings() {
+    std::vector<server_pairing_t> all;
+    std::lock_guard<std::mutex> lk(mtx);
+    for (auto const& [key, p]: paired) all.push_back(p);
+    return all;
+}
+
+/* a failed server is started again when it is asked for */
+std::shared_ptr<Server::instance_t> Server::get(std::string name) {
+    if (name.empty()) name = model;
+    std::shared_ptr<instance_t> inst;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = pool.find(name);
+        if (it != pool.end()) inst = it->second;
+    }
+    if (inst && inst->info.status == server_failed) {
+        evict(inst);
+        inst.reset();
+    }
+    if (!inst) inst = start(name);
+    if (inst) inst->last_used = std::chrono::steady_clock::now();
+    return inst;
+}
+
+std::shared_ptr<Server::instance_t> Server::start(const std::string& name) {
+    fs::path path = model_file(name);
+    std::error_code ec;
+    uint64_t size = fs::file_size(path, ec);
+    if (ec) {
+        std::cerr << "llama-server: " << path << ": " << ec.message() << 
+            std::endl;
+        return nullptr;
+    }
+
+    auto inst = std::make_shared<instance_t>(ctx);
+    inst->id = ++next_id;
+    inst->info.model = name;
+    inst->info.bytes = size + overhead;
+    inst->path = path.string();
+    inst->last_used = std::chrono::steady_clock::now();
+    attach_draft(inst);
+    make_room(inst->info.bytes);
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        for (int port = base_port; inst->info.port == 0; ++port) {
+            if (!retiring.contains(port) && 
+                std::none_of(pool.begin(), pool.end(), [port](auto const& p) {
+                    return p.second->info.port == port;
+                })) inst->info.port = port;
+        }
+    }
+    if (spawn(inst) != 0) return nullptr;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        pool[name] = inst;
     }
+    asio::co_spawn(ctx, supervise(inst), asio::detached);
+    return inst;
+}
+
+/* the server drops out of the pool at once, its process is given time
+   to exit */
+void Server::evict(std::shared_ptr<instance_t> inst) {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = pool.find(inst->info.model);
+        if (it != pool.end() && it->second == inst) pool.erase(it);
+    }
+    inst->stopping = true;
+    inst->timer.cancel();
+    for (auto& on_ready: inst->waiters) on_ready("", 0);
+    inst->waiters.clear();
+    if (inst->proc) {
+        std::cout << "llama-server: unloading " << inst->info.model << 
+            std::endl;
+        retiring.insert(inst->info.port);
+        asio::co_spawn(ctx, retire(inst), asio::detached);
+    }
+    if (on_change) on_change();
+}
+
+/* least recently used first, never the default model or one in use */
+void Server::make_room(uint64_t bytes) {
+    while (memory_budget > 0) {
+        std::shared_ptr<instance_t> victim;
+        uint64_t used = 0;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            for (auto const& [name, inst]: pool) {
+                used += inst->info.bytes;
+                if (name == model || inst->info.busy > 0) continue;
+                if (!victim || inst->last_used < victim->last_used) {
+                    victim = inst;
+                }
+            }
+        }
+        if (used + bytes <= memory_budget) return;
+        if (!victim) {
+            std::cerr << "llama-server: over the memory budget, " << 
+                "nothing to unload" << std::endl;
+            return;
+        }
+        evict(victim);
+    }
+}
+
+/* the pairing given to pair() or in the config, else with auto_draft the
+   smallest model of the same family at most a quarter of the size */
+std::string Server::pick_draft(const std::string& name) {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = drafts.find(name);
+        if (it != drafts.end()) return it->second;
+    }
+    std::string family = model_family(name);
+    if (!auto_draft || family.empty()) return "";
+    std::error_code ec;
+    uint64_t limit = fs::file_size(model_file(name), ec) / 4;
+    if (ec) return "";
+
+    std::string draft = "";
+    uint64_t smallest = limit + 1;
+    for (auto const& item: fs::directory_iterator(models_dir, ec)) {
+        std::string stem = item.path().stem().string();
+        if (item.path().extension() != ".gguf" || stem == name || 
+            model_family(stem) != family) continue;
+        uint64_t size = item.file_size(ec);
+        if (!ec && size < smallest) {
+            draft = stem;
+            smallest = size;
+        }
+    }
+    return draft;
+}
+
+/* the draft is loaded by the same server, its file counts against the
+   budget with the target */
+void Server::attach_draft(std::shared_ptr<instance_t> inst) {
+    std::string draft = pick_draft(inst->info.model);
+    uint64_t bytes = 0;
+    if (draft.size() > 0) {
+        std::error_code ec;
+        bytes = fs::file_size(model_file(draft), ec);
+        if (ec) {
+            std::cerr << "llama-server: draft " << model_file(draft) << ": " << 
+                ec.message() << std::endl;
+            draft.clear();
+            bytes = 0;
+        }
+    }
+    std::lock_guard<std::mutex> lk(mtx);
+    inst->info.bytes = inst->info.bytes - inst->draft_bytes + bytes;
+    inst->info.draft = draft;
+    inst->draft_bytes = bytes;
+}
+
+/* the process is stopped, the supervisor starts it again on the same
+   port with the draft paired with the model now */
+void Server::restart(std::shared_ptr<instance_t> inst) {
+    inst->stale = false;
+    attach_draft(inst);
+    append(inst, std::format("restarting with draft \"{}\"", 
+        inst->info.draft));
+    boost::system::error_code ec;
+    inst->interrupted = true;
+    if (inst->proc) inst->proc->interrupt(ec);
+}
+
+int Server::spawn(std::shared_ptr<instance_t> inst) {
+    std::vector<std::string> argv = args;
+    argv.insert(argv.end(), {
+        "--model", inst->path, 
+        "--host", host, 
+        "--port", std::to_string(inst->info.port)
+    });
+    if (inst->info.draft.size() > 0) {
+        argv.insert(argv.end(), {
+            "--model-draft", model_file(inst->info.draft).string()
+        });
+        argv.insert(argv.end(), draft_args.begin(), draft_args.end());
+    }
+    auto out = std::make_shared<asio::readable_pipe>(ctx);
+    auto err = std::make_shared<asio::readable_pipe>(ctx);
+    try {
+        inst->proc = std::make_unique<bp::process>(ctx.get_executor(), bin, 
+            argv, bp::process_stdio{{}, *out, *err});
+    } catch (std::exception const& e) {
+        std::cerr << "llama-server: " << bin << ": " << e.what() << std::endl;
+        return -1;
+    }
+    inst->started = std::chrono::steady_clock::now();
+    asio::co_spawn(ctx, reader(inst, out), asio::detached);
+    asio::co_spawn(ctx, reader(inst, err), asio::detached);
     return 0;
 }
+
+asio::awaitable<void> Server::supervise(std::shared_ptr<instance_t> inst) {
+    int failures = 0;
+    while (!stopping && !inst->stopping) {
+        bool up = co_await wait_ready(inst);
+        auto ready = std::chrono::steady_clock::now();
+        if (up) {
+            std::chrono::duration<float> elapsed = ready - inst->started;
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                inst->info.load_seconds = elapsed.count();
+            }
+            std::cout << "llama-server: " << inst->info.model << 
+                " ready in " << elapsed.count() << " s" << std::endl;
+            set_status(inst, server_ready);
+        }
+
+        boost::system::error_code ec;
+        int code = co_await inst->proc->async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (stopping || inst->stopping) break;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            inst->info.exit_code = code;
+        }
+        append(inst, std::format("llama-server exited with code {}", code));
+        std::cerr << "llama-server: " << inst->info.model << 
+            " exited with code " << code << std::endl;
+
+        /* a server that comes up and dies soon after is failing as much as
+           one that never comes up, only a stable run clears the count */
+        bool requested = inst->interrupted;
+        inst->interrupted = false;
+        bool stable = up && 
+            std::chrono::steady_clock::now() - ready >= stable_uptime;
+        if (stable) failures = 0;
+        bool failed = !stable && !requested;
+        /* a draft the target can't work with keeps the server from coming
+           up, it is tried again without one */
+        if (!up && !requested && inst->info.draft.size() > 0) {
+            std::cerr << "llama-server: " << inst->info.model << 
+                " dropping draft " << inst->info.draft << std::endl;
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                drafts[inst->info.model] = "";
+            }
+            attach_draft(inst);
+        }
+        /* a crash after a stable run is retried after a second, a server
+           that keeps failing waits longer each time, a restart for a new
+           draft doesn't wait */
+        if (failed && ++failures > max_restarts) {
+            set_status(inst, server_failed);
+            break;
+        }
+        set_status(inst, server_restarting);
+        inst->timer.expires_after(std::chrono::seconds(
+            failed ? std::min(30, 1 << failures) : (requested ? 0 : 1)));
+        co_await inst->timer.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (stopping || inst->stopping) break;
+        if (spawn(inst) != 0) {
+            set_status(inst, server_failed);
+            break;
+        }
+        std::lock_guard<std::mutex> lk(mtx);
+        if (!requested) ++inst->info.restarts;
+    }
+}
+
+/* the model is loaded when /health answers 200, it is polled from 50 ms
+   on so a small model is not held back by the poll interval */
+asio::awaitable<bool> Server::wait_ready(std::shared_ptr<instance_t> inst) {
+    set_status(inst, server_starting);
+    auto delay = std::chrono::milliseconds(50);
+    boost::system::error_code ec;
+    while (!stopping && !inst->stopping && inst->proc->running(ec)) {
+        std::string response;
+        int code = co_await http_async_request(url(*inst), "", "GET", 
+            "/health", "", response, std::chrono::seconds(2));
+        if (code == 200) co_return !stopping && !inst->stopping;
+
+        inst->timer.expires_after(delay);
+        co_await inst->timer.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+        delay = std::min(delay * 2, std::chrono::milliseconds(250));
+    }
+    co_return false;
+}
+
+asio::awaitable<void> Server::reader(std::shared_ptr<instance_t> inst, 
+    std::shared_ptr<asio::readable_pipe> pipe) {
+    std::string pending;
+    while (true) {
+        boost::system::error_code ec;
+        size_t n = co_await asio::async_read_until(*pipe, 
+            asio::dynamic_buffer(pending), '\n', 
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) break;
+        append(inst, pending.substr(0, n - 1));
+        pending.erase(0, n);
+    }
+    if (pending.size() > 0) append(inst, pending);
+}
+
+/* interrupt, then kill a server that does not exit in time */
+asio::awaitable<void> Server::retire(std::shared_ptr<instance_t> inst) {
+    boost::system::error_code ec;
+    inst->proc->interrupt(ec);
+    asio::steady_timer deadline(ctx);
+    for (int i=0; i<200 && inst->proc->running(ec); ++i) {
+        deadline.expires_after(std::chrono::milliseconds(50));
+        co_await deadline.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+    }
+    if (inst->proc->running(ec)) inst->proc->terminate(ec);
+    inst->proc->wait(ec);
+    retiring.erase(inst->info.port);
+}
+
+/* servers unused for idle_timeout are unloaded */
+asio::awaitable<void> Server::reaper() {
+    while (!stopping) {
+        reaper_timer.expires_after(std::chrono::seconds(10));
+        boost::system::error_code ec;
+        co_await reaper_timer.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (stopping) break;
+
+        auto now = std::chrono::steady_clock::now();
+        std::vector<std::shared_ptr<instance_t>> idle;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            for (auto const& [name, inst]: pool) {
+                if (name != model && inst->info.busy == 0 && 
+                    now - inst->last_used > idle_timeout) {
+                    idle.push_back(inst);
+                }
+            }
+        }
+        for (auto& inst: idle) evict(inst);
+    }
+}
+
+asio::awaitable<void> Server::stop() {
+    stopping = true;
+    reaper_timer.cancel();
+    std::vector<std::shared_ptr<instance_t>> all;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        for (auto const& [name, inst]: pool) all.push_back(inst);
+    }
+    for (auto& inst: all) {
+        inst->stopping = true;
+        inst->timer.cancel();
+        for (auto& on_ready: inst->waiters) on_ready("", 0);
+        inst->waiters.clear();
+        boost::system::error_code ec;
+        inst->proc->interrupt(ec);
+    }
+    /* each retire returns once its process exited or was killed */
+    for (auto& inst: all) co_await retire(inst);
+    ctx.stop();
+}
+
+void Server::set_status(std::shared_ptr<instance_t> inst, 
+    enuServerStatus status) {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        inst->info.status = status;
+        if (status == server_ready) inst->info.busy += inst->waiters.size();
+    }
+    if (status == server_ready || status == server_failed) {
+        std::string base_url = (status == server_ready) ? url(*inst) : "";
+        int id = (status == server_ready) ? inst->id : 0;
+        for (auto& on_ready: inst->waiters) on_ready(base_url, id);
+        inst->waiters.clear();
+    }
+    if (on_change) on_change();
+}
+
+void Server::append(std::shared_ptr<instance_t> inst, std::string line) {
+    if (line.size() > 0 && line.back() == '\r') line.pop_back();
+    std::lock_guard<std::mutex> lk(mtx);
+    inst->lines.push_back(std::move(line));
+    while (inst->lines.size() > log_lines) inst->lines.pop_front();
+}
+
+std::string Server::url(const instance_t& inst) const {
+    return std::format("http://{}:{}", host, inst.info.port);
+}
+
+fs::path Server::model_file(const std::string& name) const {
+    if (name == model && model_path.size() > 0) return model_path;
+    return fs::path(models_dir) / (name + ".gguf");
+}
@@ -1,9 +1,77 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <boost/asio.hpp>
 #include <boost/process.hpp>
 
+/* called with the base url of the server of a model once it is ready, 
+   "" if it could not be started, and the id of the instance that is given
+   back to release */
+typedef std::function<void (const std::string&, int)> server_ready_callback;
+
+typedef enum {
+    server_off = 0, 
+    server_starting, 
+    server_ready, 
+    server_restarting, 
+    server_failed
+} enuServerStatus;
+
+/* what the ui shows of one llama-server */
+typedef struct _server_info_t {
+    std::string model;
+    std::string draft;              //speculative decoding, "" for none
+    int port = 0;
+    enuServerStatus status = server_off;
+    float load_seconds = .0f;       //spawn to the first healthy /health
+    int restarts = 0;
+    int exit_code = 0;
+    int busy = 0;                   //requests holding it
+    uint64_t bytes = 0;             //charged against the memory budget
+} server_info_t;
+
+/* what one request generated, given back with release */
+typedef struct _server_usage_t {
+    int n_tokens = 0;
+    float seconds = .0f;            //decode time
+    int n_drafted = 0;              //tokens proposed by the draft model
+    int n_accepted = 0;             //of those, kept by the target
+} server_usage_t;
+
+/* requests served by one target and draft pair since init */
+typedef struct _server_pairing_t {
+    std::string model;
+    std::string draft;
+    int requests = 0;
+    server_usage_t usage;
+} server_pairing_t;
+
+/* one llama-server process per model, started on a port of its own the
+   first time the model is asked for. every process is supervised: /health
+   is polled until the model is loaded, a process that exits is started
+   again, its stdout and stderr are kept in a ring of log_lines lines.
+
+   the default model is started at init and never evicted. other models
+   stay warm until they were idle for idle_seconds, or until a new one
+   needs their share of memory_mb.
+
+   a model can be paired with a small draft model of the same family for
+   speculative decoding, from "draft": {"pairs": {...}} or, with "auto",
+   the smallest model in models_dir whose name only differs in the size.
+   the draft is loaded into the target's server. */
 class Server {
 public:
     static Server& instance() {
@@ -13,13 +81,105 @@ public:
     Server(const Server&) = delete;
     Server& operator=(const Server&) = delete;
 
-    int init(const nlohmann::json& config);
+    /* on_change is called from the server thread on every status change */
+    int init(const nlohmann::json& config, 
+        std::function<void ()> on_change = {});
     int shutdown();
 
+    bool managed() const { return on; };
+    const std::string& default_model() const { return model; };
+    /* requests can be sent, true when the server is not ours */
+    bool accepting();
+
+    /* the server of model, starting it if needed. "" is the default model.
+       every acquire is paired with a release of the instance it was given
+       once the request is done. */
+    void acquire(const std::string& model, server_ready_callback on_ready);
+    void release(int instance, const server_usage_t& usage = {});
+    /* start loading model ahead of the first request */
+    void warm(const std::string& model);
+    /* the draft model of model, "" for none */
+    std::string draft(const std::string& model);
+    /* use draft for model from now on, "" for none. a running server of
+       model is restarted with it once no request holds it. */
+    void pair(const std::string& model, const std::string& draft);
+
+    std::vector<server_info_t> instances();
+    std::vector<std::string> log(const std::string& model);
+    std::vector<server_pairing_t> pairings();
+
 private:
     Server() = default;
     ~Server() = default;
 
+    typedef struct _instance_t {
+        int id = 0;                 //unique, a model can be started again
+        server_info_t info;
+        std::string path;
+        std::unique_ptr<boost::process::process> proc;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point last_used;
+        bool stopping = false;
+        bool stale = false;         //paired with another draft since start
+        uint64_t draft_bytes = 0;
+        bool interrupted = false;   //stopped by restart, not a failure
+        std::vector<server_ready_callback> waiters;
+        std::deque<std::string> lines;
+        boost::asio::steady_timer timer;
+        _instance_t(boost::asio::io_context& ctx) : timer(ctx) {}
+    } instance_t;
+
+    /* everything below runs on the server thread */
+    std::shared_ptr<instance_t> get(std::string name);
+    std::shared_ptr<instance_t> start(const std::string& name);
+    void evict(std::shared_ptr<instance_t> inst);
+    void make_room(uint64_t bytes);
+    std::string pick_draft(const std::string& name);
+    void attach_draft(std::shared_ptr<instance_t> inst);
+    void restart(std::shared_ptr<instance_t> inst);
+    int spawn(std::shared_ptr<instance_t> inst);
+    boost::asio::awaitable<void> supervise(std::shared_ptr<instance_t> inst);
+    boost::asio::awaitable<bool> wait_ready(std::shared_ptr<instance_t> inst);
+    boost::asio::awaitable<void> reader(std::shared_ptr<instance_t> inst, 
+        std::shared_ptr<boost::asio::readable_pipe> pipe);
+    boost::asio::awaitable<void> retire(std::shared_ptr<instance_t> inst);
+    boost::asio::awaitable<void> reaper();
+    boost::asio::awaitable<void> stop();
+    void set_status(std::shared_ptr<instance_t> inst, enuServerStatus status);
+    void append(std::shared_ptr<instance_t> inst, std::string line);
+    std::string url(const instance_t& inst) const;
+    std::filesystem::path model_file(const std::string& name) const;
+
+    bool on = false;
+    std::string bin = "";
+    std::vector<std::string> args;  //without --model, --host and --port
+    std::string models_dir = "models";
+    std::string model = "";
+    std::string model_path = "";   //of the default model, from --model
+    std::string host = "127.0.0.1";
+    int base_port = 8080;
+    uint64_t memory_budget = 0;     //0 for no limit
+    uint64_t overhead = 0;          //kv cache and buffers per instance
+    std::chrono::seconds idle_timeout{600};
+    size_t log_lines = 500;
+    int max_restarts = 5;
+    /* up for this long, a server that exits is no longer failing */
+    std::chrono::seconds stable_uptime{60};
+    std::vector<std::string> draft_args;    //only with a draft model
+    bool auto_draft = false;
+    std::function<void ()> on_change;
+
     boost::asio::io_context ctx;
-    std::unique_ptr<boost::process::process> proc;
-};
\ No newline at end of file
+    boost::asio::steady_timer reaper_timer{ctx};
+    std::thread supervisor_thread;
+    bool stopping = false;
+    int next_id = 0;
+    std::unordered_set<int> retiring;   //ports of servers still exiting
+
+    /* written on the server thread, read by the ui */
+    std::unordered_map<std::string, std::shared_ptr<instance_t>> pool;
+    /* target to draft, "" when the target runs without one */
+    std::unordered_map<std::string, std::string> drafts;
+    std::map<std::pair<std::string, std::string>, server_pairing_t> paired;
+    std::mutex mtx;
+};
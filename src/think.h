@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+
+/* splits assistant output into reasoning and content as it streams in:
+
+     [whitespace] <think> reasoning </think> [newlines] content
+
+   chunks are fed as they arrive and emit(reasoning, span) is called with
+   spans of the chunk itself. only a tag cut by a chunk boundary is held
+   back, at most a few bytes, so a chunk costs the same however long the
+   reply already is. the whitespace ahead of <think> is dropped, output
+   without a leading <think> is all content, whitespace included. a reply
+   that ends before </think> is all reasoning. */
+typedef struct _think_parser_t {
+    template <typename F>
+    void feed(std::string_view chunk, F&& emit) {
+        if (pending.empty()) {
+            scan(chunk, emit);
+            return;
+        }
+        std::string joined = pending;
+        joined.append(chunk);
+        pending.clear();
+        scan(joined, emit);
+    }
+
+    /* end of output, flushes a tag that never completed */
+    template <typename F>
+    void finish(F&& emit) {
+        if (pending.size() > 0) emit(state == reason, 
+            std::string_view{pending});
+        pending.clear();
+        state = lead;
+    }
+
+    bool reasoning() const { return state == reason; };
+
+private:
+    static constexpr std::string_view open_tag = "<think>";
+    static constexpr std::string_view close_tag = "</think>";
+
+    /* longest end of text that could start tag */
+    static size_t partial(std::string_view text, std::string_view tag) {
+        for (size_t n = std::min(text.size(), tag.size() - 1); n > 0; --n) {
+            if (text.ends_with(tag.substr(0, n))) return n;
+        }
+        return 0;
+    }
+
+    template <typename F>
+    void scan(std::string_view text, F& emit) {
+        while (text.size() > 0) {
+            switch (state) {
+            case lead: {
+                /* the whitespace is held until it is known whether a
+                   reasoning block follows, it is content otherwise */
+                size_t i = text.find_first_not_of(" \t\r\n");
+                std::string_view rest = text.substr(std::min(i, text.size()));
+                if (rest.starts_with(open_tag)) {
+                    text = rest.substr(open_tag.size());
+                    state = reason;
+                } else if (open_tag.starts_with(rest)) {
+                    pending = text;
+                    return;
+                } else {
+                    state = content;
+                }
+                break;
+            }
+            case reason: {
+                size_t pos = text.find(close_tag);
+                if (pos != std::string_view::npos) {
+                    if (pos > 0) emit(true, text.substr(0, pos));
+                    text.remove_prefix(pos + close_tag.size());
+                    state = gap;
+                    break;
+                }
+                size_t keep = partial(text, close_tag);
+                if (text.size() > keep) {
+                    emit(true, text.substr(0, text.size() - keep));
+                }
+                pending = text.substr(text.size() - keep);
+                return;
+            }
+            case gap: {
+                size_t i = text.find_first_not_of("\r\n");
+                if (i == std::string_view::npos) return;
+                text.remove_prefix(i);
+                state = content;
+                break;
+            }
+            case content:
+                emit(false, text);
+                return;
+            }
+        }
+    }
+
+    enum { lead, reason, gap, content } state = lead;
+    std::string pending;            //start of a tag cut by the chunk end
+} think_parser_t;
+
+/* the content of a complete reply, without its reasoning */
+inline std::string think_content(std::string_view text) {
+    std::string content;
+    think_parser_t parser;
+    auto emit = [&](bool reasoning, std::string_view span) {
+        if (!reasoning) content.append(span);
+    };
+    parser.feed(text, emit);
+    parser.finish(emit);
+    return content;
+}
@@ -1,5 +1,188 @@
 #include "tools.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <format>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <iostream>
+#include <string>
 
-int LLMTools::init(const nlohmann::json& config) {
+namespace asio = boost::asio;
+
+int LLMTools::init(const nlohmann::json& config, 
+    std::function<void ()> on_added) {
+    if (!config.is_array()) return 0;
+    for (auto const& server: config) {
+        if (!server.is_object() || !server.value("enabled", true)) continue;
+        servers.push_back(std::make_unique<MCPClient>(ctx, server));
+    }
+    if (servers.empty()) return 0;
+    mcp_thread = std::thread([this]() { ctx.run(); });
+
+    /* all servers are asked at once, each one's tools show up when it
+       answers and nothing waits for the slowest */
+    auto start = std::chrono::steady_clock::now();
+    auto n_servers = std::make_shared<int>(0);
+    pending = servers.size();
+    for (auto& s: servers) {
+        MCPClient * server = s.get();
+        asio::co_spawn(ctx, server->connect(), [this, server, start, 
+            n_servers, on_added](std::exception_ptr error, int ret) {
+            if (error) {
+                try {
+                    std::rethrow_exception(error);
+                } catch (std::exception const& e) {
+                    std::cerr << "mcp " << server->name() << ": " << 
+                        e.what() << std::endl;
+                }
+                ret = -1;
+            }
+            size_t n_tools = 0;
+            if (ret == 0) {
+                ++*n_servers;
+                std::lock_guard<std::mutex> lk(mtx);
+                n_tools = tool_names.size();
+                for (auto const& tool: server->tools()) add(server, tool);
+                n_tools = tool_names.size() - n_tools;
+            }
+            std::cout << "mcp " << server->name() << ": " << n_tools << 
+                " tools in " << 
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count() << 
+                " ms" << std::endl;
+            if (--pending == 0) {
+                std::cout << "mcp: " << *n_servers << "/" << 
+                    servers.size() << " servers connected" << std::endl;
+            }
+            if (n_tools > 0 && on_added) on_added();
+        });
+    }
     return 0;
 }
+
+int LLMTools::shutdown() {
+    if (!mcp_thread.joinable()) return 0;
+    std::vector<std::future<void>> closed;
+    for (auto& server: servers) {
+        closed.push_back(asio::co_spawn(ctx, server->close(), 
+            asio::use_future));
+    }
+    for (auto& f: closed) f.wait();
+    work.reset();
+    ctx.stop();
+    mcp_thread.join();
+    return 0;
+}
+
+int LLMTools::add(const std::string& name, const nlohmann::json& info, 
+    llm_tool func) {
+    if (tool_ids.contains(name)) return -1;
+    int id = registry.size();
+    registry.push_back({name, info, std::move(func)});
+    tool_names.push_back(name);
+    tool_ids[name] = id;
+    toolsets.clear();
+    return id;
+}
+
+/* a name already taken gets the server name in front */
+void LLMTools::add(MCPClient * server, const nlohmann::json& tool) {
+    if (!tool.is_object() || !tool.contains("name") || 
+        !tool["name"].is_string()) return;
+    std::string tool_name = tool["name"].get<std::string>();
+    std::string name = tool_name;
+    if (tool_ids.contains(name)) name = server->name() + "_" + tool_name;
+
+    nlohmann::json info = {
+        {"name", name}, 
+        {"description", ""}, 
+        {"parameters", {{"type", "object"}, 
+            {"properties", nlohmann::json::object()}}}
+    };
+    if (tool.contains("description") && tool["description"].is_string()) {
+        info["description"] = tool["description"];
+    }
+    if (tool.contains("inputSchema") && tool["inputSchema"].is_object()) {
+        info["parameters"] = tool["inputSchema"];
+    }
+    add(name, info, [this, server, tool_name](const nlohmann::json& argv, 
+        std::shared_ptr<llm_tool_call_t> call) -> std::string {
+        typedef struct _pending_t {
+            std::mutex mtx;
+            std::condition_variable cv;
+            bool done = false;
+            bool given_up = false;
+            std::string result;
+        } pending_t;
+        auto pending = std::make_shared<pending_t>();
+        auto cancel = std::make_shared<mcp_cancel_t>();
+        asio::co_spawn(ctx, server->call(tool_name, argv, cancel), 
+            [pending](std::exception_ptr e, std::string result) {
+            if (e) {
+                try {
+                    std::rethrow_exception(e);
+                } catch (std::exception const& ex) {
+                    result = std::format("error: {}", ex.what());
+                }
+            }
+            std::lock_guard<std::mutex> lk(pending->mtx);
+            pending->result = std::move(result);
+            pending->done = true;
+            pending->cv.notify_all();
+        });
+        /* the call gives up on the mcp thread, the worker doesn't wait
+           for that, a server that never answers can't hold it */
+        if (call) call->on_cancel([this, cancel, pending]() {
+            asio::post(ctx, [cancel]() {
+                cancel->cancelled = true;
+                if (cancel->abort) cancel->abort();
+            });
+            std::lock_guard<std::mutex> lk(pending->mtx);
+            pending->given_up = true;
+            pending->cv.notify_all();
+        });
+        auto ready = [pending]() { return pending->done || pending->given_up; };
+        std::unique_lock<std::mutex> lk(pending->mtx);
+        if (!call || call->deadline == 
+            std::chrono::steady_clock::time_point::max()) {
+            pending->cv.wait(lk, ready);
+        } else if (!pending->cv.wait_until(lk, call->deadline, ready)) {
+            return std::format("error: {} timed out", tool_name);
+        }
+        if (!pending->done) return std::format("error: {} cancelled", 
+            tool_name);
+        return pending->result;
+    });
+}
+
+std::string LLMTools::tools(const std::vector<unsigned char>& enabled) {
+    std::lock_guard<std::mutex> lk(mtx);
+    std::vector<bool> mask(registry.size(), false);
+    for (size_t i=0; i<std::min(enabled.size(), mask.size()); ++i) {
+        mask[i] = enabled[i];
+    }
+    auto it = toolsets.find(mask);
+    if (it != toolsets.end()) return it->second;
+
+    nlohmann::json tools = nlohmann::json::array();
+    for (size_t i=0; i<mask.size(); ++i) {
+        if (!mask[i]) continue;
+        auto const& info = registry[i].info;
+        tools.push_back({
+            {"type", "function"}, 
+            {"function", {
+                {"name", info.value("name", registry[i].name)}, 
+                {"description", info.value("description", "")}, 
+                {"parameters", info.value("parameters", 
+                    nlohmann::json::object())}
+            }}
+        });
+    }
+    std::string serialized = tools.empty() ? "" : tools.dump(-1, ' ', false, 
+        nlohmann::json::error_handler_t::replace);
+    auto added = toolsets.emplace(std::move(mask), std::move(serialized));
+    return added.first->second;
+}
@@ -1,14 +1,25 @@
 #pragma once
 
+#include "llm.h"
+#include "mcp.h"
+#include <atomic>
 #include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <nlohmann/json_fwd.hpp>
+#include <thread>
 #include <unordered_map>
 #include <vector>
+#include <boost/asio.hpp>
 
-typedef std::function<std::string (const nlohmann::json&)> llm_tool;
+/* argv of the call, the call is cancelled when the llm stops waiting */
+typedef std::function<std::string (const nlohmann::json&, 
+    std::shared_ptr<llm_tool_call_t>)> llm_tool;
 
-inline std::string get_weather(const nlohmann::json& argv) {
+inline std::string get_weather(const nlohmann::json& argv, 
+    std::shared_ptr<llm_tool_call_t>) {
     std::vector<std::string> weather = {
         "sunny", "cloudy", "rainy", "snowy", "windy"
     };
@@ -36,6 +47,13 @@ static nlohmann::json get_weather_properties = R"(
     }
 )"_json;
 
+/* a registered tool, its id is the position in names() and never changes */
+typedef struct _llm_tool_entry_t {
+    std::string name;
+    nlohmann::json info;            //name, description, parameters
+    llm_tool func;
+} llm_tool_entry_t;
+
 class LLMTools {
 public:
     static LLMTools& instance() {
@@ -45,34 +63,91 @@ public:
     LLMTools(const LLMTools&) = delete;
     LLMTools& operator=(const LLMTools&) = delete;
 
-    int init(const nlohmann::json& config);
-    
-    const std::vector<std::string>& names() {
+    /* config is the "mcp" array. the servers are connected in the
+       background, the tools of each are added once it answers and their
+       schemas kept for the requests. on_added runs on the mcp thread after
+       a server's tools were added. */
+    int init(const nlohmann::json& config, 
+        std::function<void ()> on_added = {});
+    int shutdown();
+
+    /* servers still connecting */
+    int connecting() const { return pending; };
+
+    size_t size() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return tool_names.size();
+    }
+
+    std::vector<std::string> names() {
+        std::lock_guard<std::mutex> lk(mtx);
         return tool_names;
     }
 
+    /* -1 for an unknown name */
+    int id(const std::string& name) {
+        std::lock_guard<std::mutex> lk(mtx);
+        return find(name);
+    }
+
+    nlohmann::json operator[](int id) {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (id < 0 || id >= int(registry.size())) return {};
+        return registry[id].info;
+    }
+
     nlohmann::json operator[](const std::string& name) {
-        if (!tool_info_map.contains(name)) return {};
-        return tool_info_map[name];
+        return (*this)[id(name)];
     }
 
+    /* the "tools" array of a request serialized, "" if none is enabled.
+       enabled is indexed by tool id. it is built once per set of enabled
+       tools and kept until a tool is added, the llm splices it into the
+       body as it is. */
+    std::string tools(const std::vector<unsigned char>& enabled);
+
+    /* the tool runs without the lock, servers keep adding meanwhile */
     nlohmann::json response(const std::string& name, 
-        const nlohmann::json& argv) {
-        if (!tool_func_map.contains(name)) return {};
-        return tool_func_map[name](argv);
+        const nlohmann::json& argv, std::shared_ptr<llm_tool_call_t> call) {
+        llm_tool func;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            int i = find(name);
+            if (i < 0) return {};
+            func = registry[i].func;
+        }
+        return func(argv, call);
     }
 
 private:
-    LLMTools() = default;
+    LLMTools() {
+        add("get_weather", get_weather_properties, get_weather);
+    }
     ~LLMTools() = default;
 
-    std::vector<std::string> tool_names = {
-        "get_weather"
-    };
-    std::unordered_map<std::string, nlohmann::json> tool_info_map = {
-        {"get_weather", get_weather_properties}
-    };
-    std::unordered_map<std::string, llm_tool> tool_func_map = {
-        {"get_weather", get_weather}
-    };
+    /* called with mtx held */
+    int find(const std::string& name) const {
+        auto it = tool_ids.find(name);
+        return it == tool_ids.end() ? -1 : it->second;
+    }
+    /* -1 if the name is taken, called with mtx held */
+    int add(const std::string& name, const nlohmann::json& info, 
+        llm_tool func);
+    void add(MCPClient * server, const nlohmann::json& tool);
+
+    /* the registry only grows, from the mcp thread once init returned */
+    std::mutex mtx;
+    std::vector<llm_tool_entry_t> registry;
+    std::vector<std::string> tool_names;
+    std::unordered_map<std::string, int> tool_ids;
+    std::unordered_map<std::vector<bool>, std::string> toolsets;
+
+    /* mcp sessions live on their own io thread, a tool call waits there
+       from the llm tool pool */
+    boost::asio::io_context ctx;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> 
+        work{ctx.get_executor()};
+    std::thread mcp_thread;
+    std::vector<std::unique_ptr<MCPClient>> servers;
+    std::atomic<int> pending = 0;
 };
\ No newline at end of file
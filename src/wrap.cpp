@@ -0,0 +1,165 @@
+#include "wrap.h"
+#include <algorithm>
+#include <string>
+#include <string_view>
+
+static const size_t max_word_len = 16;
+
+/* bytes of the utf-8 sequence led by c, 1 for stray bytes */
+static size_t utf8_len(unsigned char c) {
+    if ((c & 0xe0) == 0xc0) return 2;
+    if ((c & 0xf0) == 0xe0) return 3;
+    if ((c & 0xf8) == 0xf0) return 4;
+    return 1;
+}
+
+static uint32_t utf8_decode(std::string_view glyph) {
+    unsigned char c = glyph[0];
+    if (glyph.size() == 1) return c;
+    uint32_t cp = c & (0x7f >> glyph.size());
+    for (size_t i=1; i<glyph.size(); ++i) {
+        cp = (cp << 6) | (glyph[i] & 0x3f);
+    }
+    return cp;
+}
+
+static size_t glyph_len(std::string_view text, size_t i) {
+    return std::min(utf8_len(text[i]), text.size() - i);
+}
+
+/* a space ends an ascii word, so does max_word_len. every wider codepoint
+   is a word of its own. */
+static size_t word_end(std::string_view text, size_t i) {
+    if (text[i] & 0x80) return i + glyph_len(text, i);
+    size_t end = i;
+    while (end < text.size() && !(text[end] & 0x80) && text[end] != '\n' && 
+        end - i <= max_word_len) {
+        if (text[end++] == ' ') break;
+    }
+    return end;
+}
+
+static bool soft_break(std::string_view text, size_t i) {
+    return i + 1 < text.size() && text[i] == ' ' && text[i + 1] == '\n';
+}
+
+static bool hard_break(std::string_view text, size_t i) {
+    return text[i] == '\n' && (i == 0 || text[i - 1] != ' ');
+}
+
+void TextWrap::edit(ImGuiInputTextCallbackData * data, float max_width) {
+    std::string_view text{data->Buf, size_t(data->BufTextLen)};
+
+    /* the edit is what differs from the previous buffer, widened to the
+       hard line breaks around it */
+    size_t n = std::min(text.size(), previous.size());
+    size_t prefix = std::mismatch(text.begin(), text.begin() + n, 
+        previous.begin()).first - text.begin();
+    size_t suffix = std::mismatch(text.rbegin(), text.rbegin() + 
+        (n - prefix), previous.rbegin()).first - text.rbegin();
+    size_t start = prefix;
+    while (start > 0 && !hard_break(text, start - 1)) --start;
+    size_t end = text.size() - suffix;
+    while (end < text.size() && !hard_break(text, end)) ++end;
+    if (resized(max_width)) {
+        start = 0;
+        end = text.size();
+        wrap_width = max_width;
+    }
+
+    size_t cursor = data->CursorPos;
+    size_t cursor_logical = std::string::npos;
+    logical.clear();
+    for (size_t i=start; i<end;) {
+        size_t step = soft_break(text, i) ? 2 : 1;
+        if (cursor >= i && cursor < i + step) {
+            cursor_logical = logical.size();
+        }
+        if (step == 1) logical.push_back(text[i]);
+        i += step;
+    }
+    if (cursor == end) cursor_logical = logical.size();
+
+    size_t cursor_wrapped = std::string::npos;
+    wrapped.clear();
+    float line_width = .0f;
+    for (size_t i=0; i<logical.size();) {
+        if (logical[i] == '\n') {
+            if (cursor_logical == i) cursor_wrapped = wrapped.size();
+            wrapped.push_back('\n');
+            line_width = .0f;
+            ++i;
+            continue;
+        }
+        size_t j = word_end(logical, i);
+        float w = width(std::string_view{logical}.substr(i, j - i));
+        if (line_width > .0f && line_width + w >= max_width) {
+            wrapped += " \n";
+            line_width = .0f;
+        }
+        if (cursor_logical >= i && cursor_logical < j) {
+            cursor_wrapped = wrapped.size() + cursor_logical - i;
+        }
+        wrapped.append(logical, i, j - i);
+        line_width += w;
+        i = j;
+    }
+    if (cursor_logical == logical.size()) cursor_wrapped = wrapped.size();
+
+    bool fits = data->BufTextLen - (end - start) + wrapped.size() < 
+        size_t(data->BufSize) || 
+        (data->Flags & ImGuiInputTextFlags_CallbackResize);
+    if (fits && text.substr(start, end - start) != wrapped) {
+        data->DeleteChars(start, end - start);
+        data->InsertChars(start, wrapped.data(), 
+            wrapped.data() + wrapped.size());
+        if (cursor_wrapped != std::string::npos) {
+            data->CursorPos = start + cursor_wrapped;
+            data->SelectionStart = data->SelectionEnd = data->CursorPos;
+        }
+    }
+    previous.assign(data->Buf, data->BufTextLen);
+}
+
+ImVec2 TextWrap::cursor(std::string_view text, int pos) {
+    text = text.substr(0, std::clamp<size_t>(pos, 0, text.size()));
+    size_t line = text.rfind('\n');
+    int lines = std::count(text.begin(), text.end(), '\n');
+    float x = width(line == std::string_view::npos ? text : 
+        text.substr(line + 1));
+    return {x, lines * ImGui::GetFontSize()};
+}
+
+float TextWrap::width(std::string_view text) {
+    float w = .0f;
+    for (size_t i=0; i<text.size();) {
+        size_t len = glyph_len(text, i);
+        w += advance(text.substr(i, len));
+        i += len;
+    }
+    return w;
+}
+
+float TextWrap::advance(std::string_view glyph) {
+    if (font != ImGui::GetFont() || font_size != ImGui::GetFontSize()) {
+        font = ImGui::GetFont();
+        font_size = ImGui::GetFontSize();
+        bmp.assign(0x10000, -1.0f);
+        astral.clear();
+    }
+    uint32_t cp = utf8_decode(glyph);
+    float * cached = nullptr;
+    if (cp < bmp.size()) {
+        cached = &bmp[cp];
+    } else {
+        auto it = astral.find(cp);
+        if (it != astral.end()) return it->second;
+    }
+    if (cached && *cached >= .0f) return *cached;
+
+    float w = ImGui::CalcTextSize(glyph.data(), 
+        glyph.data() + glyph.size()).x;
+    if (cached) *cached = w;
+    else astral[cp] = w;
+    return w;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "imgui.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/* soft line breaks of the message editor. they are kept in the buffer as
+   " \n" so ImGui draws the wrapped lines, and dropped again before the
+   message is sent.
+
+   an edit only rewraps the lines it touched, found against the buffer of
+   the previous edit, a new width rewraps them all. widths are summed from a per-codepoint cache of the
+   current font, so nothing is allocated once the buffers have grown. */
+class TextWrap {
+public:
+    /* rewrap the lines changed by the edit in data, every line if
+       max_width changed since the last call */
+    void edit(ImGuiInputTextCallbackData * data, float max_width);
+    /* the lines were wrapped for another width */
+    bool resized(float max_width) const { return max_width != wrap_width; };
+    /* the buffer was emptied outside the editor */
+    void clear() { previous.clear(); };
+    /* offset of the cursor at pos from the top left of text */
+    ImVec2 cursor(std::string_view text, int pos);
+    float width(std::string_view text);
+
+private:
+    float advance(std::string_view glyph);
+
+    std::string previous;           //buffer after the last edit
+    float wrap_width = -1.0f;       //max_width of the last edit
+    std::string logical;            //edited lines without soft breaks
+    std::string wrapped;
+
+    ImFont * font = nullptr;
+    float font_size = .0f;
+    std::vector<float> bmp;         //advance per codepoint, < 0 unknown
+    std::unordered_map<uint32_t, float> astral;
+};
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+# stand-in model context protocol server for mcp_test.
+#
+#   mcp_server.py             json-rpc lines on stdin and stdout
+#   mcp_server.py --http      streamable http on a free port, printed first
+#
+# tools: echo returns its text, slow waits for seconds, forget drops every
+# http session so the next request gets 404, initializes counts initialize.
+
+import json
+import sys
+import threading
+import time
+import uuid
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+TOOLS = [
+    {"name": "echo", "description": "echo the text",
+     "inputSchema": {"type": "object",
+                     "properties": {"text": {"type": "string"}}}},
+    {"name": "slow", "description": "wait for seconds",
+     "inputSchema": {"type": "object",
+                     "properties": {"seconds": {"type": "number"}}}},
+    {"name": "forget", "description": "drop the http sessions",
+     "inputSchema": {"type": "object", "properties": {}}},
+    {"name": "initializes", "description": "count of initialize",
+     "inputSchema": {"type": "object", "properties": {}}},
+]
+
+state = {"initializes": 0, "sessions": set()}
+lock = threading.Lock()
+
+
+def text(s, error=False):
+    return {"content": [{"type": "text", "text": s}], "isError": error}
+
+
+def call(name, arguments):
+    if name == "echo":
+        return text(arguments.get("text", ""))
+    if name == "slow":
+        time.sleep(arguments.get("seconds", 1))
+        return text("done")
+    if name == "forget":
+        with lock:
+            state["sessions"].clear()
+        return text("forgotten")
+    if name == "initializes":
+        return text(str(state["initializes"]))
+    return text("unknown tool " + name, True)
+
+
+def handle(message):
+    """the response to message, None for a notification"""
+    method = message.get("method", "")
+    if "id" not in message:
+        return None
+    reply = {"jsonrpc": "2.0", "id": message["id"]}
+    params = message.get("params", {})
+    if method == "initialize":
+        with lock:
+            state["initializes"] += 1
+        reply["result"] = {
+            "protocolVersion": params.get("protocolVersion", ""),
+            "capabilities": {"tools": {}},
+            "serverInfo": {"name": "stand-in", "version": "1.0"}}
+    elif method == "tools/list":
+        # two pages, to exercise the cursor
+        if params.get("cursor") == "2":
+            reply["result"] = {"tools": TOOLS[2:]}
+        else:
+            reply["result"] = {"tools": TOOLS[:2], "nextCursor": "2"}
+    elif method == "tools/call":
+        reply["result"] = call(params.get("name", ""),
+                               params.get("arguments", {}))
+    else:
+        reply["error"] = {"code": -32601, "message": "method not found"}
+    return reply
+
+
+def stdio():
+    out = threading.Lock()
+
+    def answer(message):
+        reply = handle(message)
+        if reply is None:
+            return
+        with out:
+            sys.stdout.write(json.dumps(reply) + "\n")
+            sys.stdout.flush()
+
+    for line in sys.stdin:
+        message = json.loads(line)
+        # calls run side by side, like a real server
+        threading.Thread(target=answer, args=(message,), daemon=True).start()
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def reply(self, status, body=b"", headers=None):
+        self.send_response(status)
+        for key, value in (headers or {}).items():
+            self.send_header(key, value)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        message = json.loads(body)
+        session = self.headers.get("Mcp-Session-Id")
+        headers = {}
+        if message.get("method") == "initialize":
+            session = uuid.uuid4().hex
+            with lock:
+                state["sessions"].add(session)
+            headers["Mcp-Session-Id"] = session
+        else:
+            with lock:
+                known = session in state["sessions"]
+            if not known:
+                self.reply(404)
+                return
+        reply = handle(message)
+        if reply is None:
+            self.reply(202)
+            return
+        # answered as an event stream, the client reads both kinds
+        data = "event: message\ndata: " + json.dumps(reply) + "\n\n"
+        headers["Content-Type"] = "text/event-stream"
+        self.reply(200, data.encode(), headers)
+
+    def do_DELETE(self):
+        with lock:
+            state["sessions"].discard(self.headers.get("Mcp-Session-Id"))
+        self.reply(200)
+        threading.Thread(target=self.server.shutdown, daemon=True).start()
+
+
+def http():
+    server = ThreadingHTTPServer(("127.0.0.1", 0), Handler)
+    print(server.server_address[1], flush=True)
+    # a test that dies early doesn't leave the server behind for long
+    timer = threading.Timer(60, server.shutdown)
+    timer.daemon = True
+    timer.start()
+    server.serve_forever()
+    sys.exit(0)
+
+
+if __name__ == "__main__":
+    http() if "--http" in sys.argv else stdio()
@@ -0,0 +1,139 @@
+#include "mcp.h"
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+/* MCPClient against mcp_server.py, over stdio and over http:
+
+     mcp_test <python> <mcp_server.py>
+
+   returns the number of failed checks. */
+
+namespace asio = boost::asio;
+
+static int failed = 0;
+
+static void check(bool ok, const std::string& what) {
+    std::cout << (ok ? "ok   " : "FAIL ") << what << std::endl;
+    if (!ok) ++failed;
+}
+
+/* run a coroutine of the client on the io thread and wait for it */
+template <typename T>
+static T run(asio::io_context& ctx, asio::awaitable<T> a) {
+    return asio::co_spawn(ctx, std::move(a), asio::use_future).get();
+}
+
+static std::vector<std::string> names(const MCPClient& client) {
+    std::vector<std::string> names;
+    for (auto const& tool: client.tools()) {
+        names.push_back(tool.value("name", ""));
+    }
+    return names;
+}
+
+static void test_stdio(asio::io_context& ctx, const std::string& python,
+    const std::string& script) {
+    MCPClient client(ctx, {
+        {"name", "stdio"},
+        {"command", python},
+        {"args", {script}},
+        {"timeout", 10}
+    });
+    check(run(ctx, client.connect()) == 0, "stdio: initialize");
+    check(names(client) == std::vector<std::string>{
+        "echo", "slow", "forget", "initializes"}, "stdio: tools/list pages");
+
+    std::string echo = run(ctx, client.call("echo", {{"text", "hello"}}));
+    check(echo == "hello", "stdio: tools/call echo");
+    std::string unknown = run(ctx, client.call("nope",
+        nlohmann::json::object()));
+    check(unknown.starts_with("error: "), "stdio: tools/call error");
+
+    /* two calls overlap, the fast one isn't held up by the slow one */
+    auto slow = asio::co_spawn(ctx, client.call("slow", {{"seconds", 1}}),
+        asio::use_future);
+    auto start = std::chrono::steady_clock::now();
+    std::string fast = run(ctx, client.call("echo", {{"text", "fast"}}));
+    check(fast == "fast" && std::chrono::steady_clock::now() - start <
+        std::chrono::milliseconds(900), "stdio: calls overlap");
+    check(slow.get() == "done", "stdio: slow call");
+
+    /* a cancelled call returns at once */
+    auto cancel = std::make_shared<mcp_cancel_t>();
+    auto cancelled = asio::co_spawn(ctx, client.call("slow",
+        {{"seconds", 5}}, cancel), asio::use_future);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    start = std::chrono::steady_clock::now();
+    asio::post(ctx, [cancel]() {
+        cancel->cancelled = true;
+        if (cancel->abort) cancel->abort();
+    });
+    check(cancelled.get().starts_with("error: ") &&
+        std::chrono::steady_clock::now() - start < std::chrono::seconds(1),
+        "stdio: cancelled call");
+
+    run(ctx, client.close());
+}
+
+static void test_http(asio::io_context& ctx, const std::string& python,
+    const std::string& script) {
+    std::string command = python + " " + script + " --http";
+    std::FILE * server = ::popen(command.c_str(), "r");
+    char line[32] = {0};
+    if (!server || !std::fgets(line, sizeof(line), server)) {
+        check(false, "http: start the server");
+        if (server) ::pclose(server);
+        return;
+    }
+    std::string url = std::string("http://127.0.0.1:") +
+        std::to_string(std::atoi(line)) + "/mcp";
+
+    {
+        MCPClient client(ctx, {
+            {"name", "http"},
+            {"url", url},
+            {"timeout", 10}
+        });
+        check(run(ctx, client.connect()) == 0, "http: initialize");
+        check(names(client).size() == 4, "http: tools/list pages");
+        check(run(ctx, client.call("echo", {{"text", "hello"}})) == "hello",
+            "http: tools/call echo");
+
+        /* the server forgets the session, the next call gets 404 and is
+           sent again on a new one */
+        run(ctx, client.call("forget", nlohmann::json::object()));
+        check(run(ctx, client.call("echo", {{"text", "again"}})) == "again",
+            "http: 404 initializes again");
+        check(run(ctx, client.call("initializes",
+            nlohmann::json::object())) == "2", "http: one new session");
+        /* the server exits once the session is deleted */
+        run(ctx, client.close());
+    }
+    ::pclose(server);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 3) {
+        std::cerr << "usage: mcp_test <python> <mcp_server.py>" << std::endl;
+        return 1;
+    }
+    asio::io_context ctx;
+    auto work = asio::make_work_guard(ctx);
+    std::thread io([&ctx]() { ctx.run(); });
+
+    test_stdio(ctx, argv[1], argv[2]);
+    test_http(ctx, argv[1], argv[2]);
+
+    work.reset();
+    ctx.stop();
+    io.join();
+    return failed;
+}